@@ -52,29 +52,143 @@ int bitmap_init(bitmap_t *b, uint32_t nbits)
 	return 0;
 }
 
+// Mask of the bits of word idx that are within the first nbits bits.
+static size_t word_valid_bits(uint32_t nbits, uint32_t idx)
+{
+	uint32_t last_bits = nbits % bits_per_word;
+	if (idx == nbits / bits_per_word && last_bits != 0) {
+		return ((size_t)1 << last_bits) - 1;
+	}
+	return word_all_bits;
+}
+
 // Find the first unused bit in bitmap b and return the index of the bit in *index.
 // Returns 0 on success and -1 if all bits are already marked as in-use.
 int bitmap_alloc(bitmap_t *b, uint32_t nbits, uint32_t *index)
 {
-	uint32_t max_idx = div_round_up(nbits, bits_per_word);
+	return bitmap_alloc_from(b, nbits, 0, index);
+}
+
+// Mark the first unused bit of words [from, to) of bitmap b as in-use, not
+// counting the bits in skip of word from, and return its index in *index.
+// Full words cost a single comparison. Returns false if there is none.
+static bool alloc_in_words(size_t *words, uint32_t nbits, uint32_t from, uint32_t to,
+                           size_t skip, uint32_t *index)
+{
+	for (uint32_t idx = from; idx < to; ++idx) {
+		size_t used_bits = words[idx] | skip;
+		skip = 0;
+		if (used_bits == word_all_bits) {
+			continue;
+		}
+		size_t free_bits = ~used_bits & word_valid_bits(nbits, idx);
+		if (free_bits != 0) {
+			uint32_t offset = __builtin_ctzl(free_bits);
+			words[idx] |= (size_t)1 << offset;
+			*index = (idx * bits_per_word) + offset;
+			assert(*index < nbits);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Find the first unused bit at or after start in bitmap b, wrapping around to
+// the beginning, and return the index of the bit in *index.
+// Returns 0 on success and -1 if all bits are already marked as in-use.
+int bitmap_alloc_from(bitmap_t *b, uint32_t nbits, uint32_t start, uint32_t *index)
+{
+	uint32_t nwords = div_round_up(nbits, bits_per_word);
+	size_t *words = (size_t *)b;
+
+	if (start >= nbits) {
+		start = 0;
+	}
+	uint32_t first = start / bits_per_word;
+	// Bits before start in its word are only looked at after wrapping around
+	size_t skip = ((size_t)1 << (start % bits_per_word)) - 1;
+
+	// The first word is visited twice in case the only free bits are before start
+	if (alloc_in_words(words, nbits, first, nwords, skip, index) ||
+	    alloc_in_words(words, nbits, 0, first + 1, 0, index)) {
+		return 0;
+	}
+	return -1;
+}
+
+// Look for runs of unused bits within bits [from, to) of bitmap b, keeping the
+// longest one seen so far (at most want bits long) in *best_start and *best_len.
+// Bits that are set in mask count as in-use too, unless mask is NULL.
+// The search stops once *best_len reaches want. Full and empty words are each
+// stepped over at once.
+void bitmap_find_run(bitmap_t *b, bitmap_t *mask, uint32_t from, uint32_t to, uint32_t want,
+                     uint32_t *best_start, uint32_t *best_len)
+{
 	size_t *words = (size_t *)b;
+	size_t *mask_words = (size_t *)mask;
+	uint32_t run_start = from;
+	uint32_t run_len = 0;
+
+	for (uint32_t bit = from; bit < to && *best_len < want; ) {
+		uint32_t offset = bit % bits_per_word;
+		uint32_t avail = bits_per_word - offset;
+		if (avail > to - bit) {
+			avail = to - bit;
+		}
+		// The bits from bit onwards in its word, with 1 meaning unused
+		size_t used_bits = words[bit / bits_per_word];
+		if (mask_words != NULL) {
+			used_bits |= mask_words[bit / bits_per_word];
+		}
+		size_t free_bits = ~used_bits >> offset;
+		size_t other_bits = (free_bits & 1) ? ~free_bits : free_bits;
+		uint32_t len = (other_bits == 0) ? avail : (uint32_t)__builtin_ctzl(other_bits);
+		if (len > avail) {
+			len = avail;
+		}
 
-	for (uint32_t idx = 0; idx < max_idx; ++idx) {
-		if (words[idx] != word_all_bits) {
-			for (uint32_t offset = 0; offset < bits_per_word; ++offset) {
-				size_t mask = (size_t)1 << offset;
-
-				if ((words[idx] & mask) == 0) {
-					words[idx] |= mask;
-					*index = (idx * bits_per_word) + offset;
-					assert(*index < nbits);
-					return 0;
-				}
+		if (free_bits & 1) {
+			if (run_len == 0) {
+				run_start = bit;
+			}
+			run_len += len;
+			if (run_len > *best_len) {
+				*best_start = run_start;
+				*best_len = (run_len < want) ? run_len : want;
 			}
-			assert(false);
+		} else {
+			run_len = 0;
 		}
+		bit += len;
 	}
-	return -1;
+}
+
+// Find a run of want unused bits in bitmap b, starting the search at bit from
+// and wrapping around to the beginning. If there is no such run, the longest
+// run of unused bits is taken instead. The bits are marked as in-use, and the
+// first index and number of bits are returned in *start and *got.
+// Returns 0 on success and -1 if all bits are already marked as in-use.
+int bitmap_alloc_range(bitmap_t *b, uint32_t nbits, uint32_t from, uint32_t want,
+                       uint32_t *start, uint32_t *got)
+{
+	assert(want > 0);
+
+	if (from >= nbits) {
+		from = 0;
+	}
+	*got = 0;
+	bitmap_find_run(b, NULL, from, nbits, want, start, got);
+	// Runs that started before from and carried on past it were only seen in part
+	uint32_t wrap_to = (want < nbits - from) ? from + want : nbits;
+	bitmap_find_run(b, NULL, 0, wrap_to, want, start, got);
+	if (*got == 0) {
+		return -1;
+	}
+
+	for (uint32_t index = *start; index < *start + *got; ++index) {
+		bitmap_set(b, nbits, index, true);
+	}
+	return 0;
 }
 
 // Marks the bit at the given index as available (0).
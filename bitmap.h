@@ -41,6 +41,29 @@ int bitmap_init(bitmap_t *b, uint32_t nbits);
 // Returns 0 on success and -1 if all bits are already marked as in-use.
 int bitmap_alloc(bitmap_t *b, uint32_t nbits, uint32_t *index);
 
+// Find the first unused bit at or after start in bitmap b, wrapping around to
+// the beginning, and return the index of the bit in *index.
+// Returns 0 on success and -1 if all bits are already marked as in-use.
+int bitmap_alloc_from(bitmap_t *b, uint32_t nbits, uint32_t start, uint32_t *index);
+
+// Look for runs of unused bits within bits [from, to) of bitmap b, keeping the
+// longest one seen so far (at most want bits long) in *best_start and *best_len.
+// Bits that are set in mask count as in-use too, unless mask is NULL.
+// The search stops once *best_len reaches want; set *best_len to 0 to start a
+// new search. No bits are marked as in-use.
+void bitmap_find_run(bitmap_t *b, bitmap_t *mask, uint32_t from, uint32_t to, uint32_t want,
+                     uint32_t *best_start, uint32_t *best_len);
+
+// Find a run of want unused bits in bitmap b, starting the search at bit from
+// and wrapping around to the beginning. If there is no such run, the longest
+// run of unused bits is taken instead. The bits are marked as in-use, and the
+// first index and number of bits are returned in *start and *got. A mounted
+// file system goes through bitmap_summary_alloc_range() instead, which does
+// the same search but steps over full regions of the bitmap.
+// Returns 0 on success and -1 if all bits are already marked as in-use.
+int bitmap_alloc_range(bitmap_t *b, uint32_t nbits, uint32_t from, uint32_t want,
+                       uint32_t *start, uint32_t *got);
+
 // Marks the bit at the given index as available (0).
 // The supplied index must be less than the number of bits in the bitmap.
 // The bitmap at the supplied index must be marked allocated.
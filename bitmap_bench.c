@@ -0,0 +1,145 @@
+/**
+ * CSC369 Assignment 4 - Microbenchmark of bitmap allocation.
+ *
+ * Compares the bit-by-bit first-fit search that bitmap_alloc() used to do
+ * with the word-at-a-time bitmap_alloc() and with bitmap_alloc_from() kept
+ * moving by a next-fit cursor, the way the file system allocates blocks and
+ * inodes (see allocate_bitmap_index()). Each bitmap starts out with a given
+ * share of its bits in use, spread at random, and half of the rest are then
+ * allocated one at a time.
+ *
+ * Usage: bitmap_bench [nbits] [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bitmap.h"
+
+static const uint32_t bits_per_word = sizeof(size_t) * CHAR_BIT;
+static const size_t word_all_bits = (size_t)-1;
+
+// The search of bitmap_alloc() before it looked at whole words.
+static int old_bitmap_alloc(bitmap_t *b, uint32_t nbits, uint32_t *index)
+{
+	uint32_t max_idx = div_round_up(nbits, bits_per_word);
+	size_t *words = (size_t *)b;
+
+	for (uint32_t idx = 0; idx < max_idx; ++idx) {
+		if (words[idx] != word_all_bits) {
+			for (uint32_t offset = 0; offset < bits_per_word; ++offset) {
+				size_t mask = (size_t)1 << offset;
+
+				if ((words[idx] & mask) == 0) {
+					words[idx] |= mask;
+					*index = (idx * bits_per_word) + offset;
+					assert(*index < nbits);
+					return 0;
+				}
+			}
+			assert(false);
+		}
+	}
+	return -1;
+}
+
+enum search { SEARCH_OLD, SEARCH_FIRST_FIT, SEARCH_NEXT_FIT };
+
+static const char *search_names[] = {
+	"bit-by-bit first fit (old)",
+	"word first fit",
+	"word next fit (cursor)",
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fill bitmap b with nbits bits, each of which is in use with probability
+// percent / 100. Returns the number of bits left unused.
+static uint32_t fill_random(bitmap_t *b, uint32_t nbits, uint32_t percent)
+{
+	uint64_t state = 0x9e3779b97f4a7c15ull;
+	uint32_t unused = 0;
+
+	bitmap_init(b, nbits);
+	for (uint32_t i = 0; i < nbits; ++i) {
+		// xorshift64, so that every run uses the same bitmap
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		if (state % 100 < percent) {
+			bitmap_set(b, nbits, i, true);
+		} else {
+			unused += 1;
+		}
+	}
+	return unused;
+}
+
+// Allocate count bits from a copy of bitmap start with the given search,
+// rounds times over. Returns the average time of an allocation in ns.
+static double run(enum search search, const bitmap_t *start, bitmap_t *b,
+                  size_t nwords, uint32_t nbits, uint32_t count, uint32_t rounds)
+{
+	double total = 0;
+	uint32_t index;
+
+	for (uint32_t r = 0; r < rounds; ++r) {
+		memcpy(b, start, nwords * sizeof(bitmap_t));
+		uint32_t cursor = 0;
+		double begin = now();
+		for (uint32_t i = 0; i < count; ++i) {
+			int err;
+			if (search == SEARCH_OLD) {
+				err = old_bitmap_alloc(b, nbits, &index);
+			} else if (search == SEARCH_FIRST_FIT) {
+				err = bitmap_alloc(b, nbits, &index);
+			} else {
+				err = bitmap_alloc_from(b, nbits, cursor, &index);
+				cursor = index + 1;
+			}
+			assert(err == 0);
+			(void)err;
+		}
+		total += now() - begin;
+	}
+	return total * 1e9 / ((double)count * rounds);
+}
+
+int main(int argc, char *argv[])
+{
+	// The data bitmap of a 1 GiB image by default
+	uint32_t nbits = (argc > 1) ? strtoul(argv[1], NULL, 0) : 262144;
+	uint32_t rounds = (argc > 2) ? strtoul(argv[2], NULL, 0) : 3;
+	static const uint32_t occupancies[] = { 10, 50, 99 };
+
+	size_t nwords = div_round_up(nbits, bits_per_word);
+	bitmap_t *start = malloc(nwords * sizeof(bitmap_t));
+	bitmap_t *b = malloc(nwords * sizeof(bitmap_t));
+	if (nbits == 0 || rounds == 0 || start == NULL || b == NULL) {
+		fprintf(stderr, "Usage: %s [nbits] [rounds]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%u bits, %u rounds\n", nbits, rounds);
+	for (size_t o = 0; o < sizeof(occupancies) / sizeof(occupancies[0]); ++o) {
+		uint32_t count = fill_random(start, nbits, occupancies[o]) / 2;
+		if (count == 0) {
+			continue;
+		}
+		printf("%u%% in use, %u allocations:\n", occupancies[o], count);
+		for (enum search s = SEARCH_OLD; s <= SEARCH_NEXT_FIT; ++s) {
+			double ns = run(s, start, b, nwords, nbits, count, rounds);
+			printf("  %-28s %10.1f ns/alloc\n", search_names[s], ns);
+		}
+	}
+
+	free(start);
+	free(b);
+	return 0;
+}
@@ -0,0 +1,273 @@
+/**
+ * CSC369 Assignment 4 - In-memory bitmap summary implementation.
+ */
+
+#include <stdlib.h>
+
+#include "bitmap_summary.h"
+
+static const uint32_t bits_per_word = sizeof(size_t) * CHAR_BIT;
+static const size_t word_all_bits = (size_t)-1;
+
+/** Mask of the bits of bitmap word w that are within the bitmap. */
+static size_t valid_bits(bitmap_summary *s, uint32_t w)
+{
+	uint32_t last_bits = s->nbits % bits_per_word;
+	if (w == s->nwords - 1 && last_bits != 0) {
+		return ((size_t)1 << last_bits) - 1;
+	}
+	return word_all_bits;
+}
+
+/** Get the unused bits of bitmap word w that aren't reserved. */
+static size_t free_bits(bitmap_summary *s, uint32_t w)
+{
+	return ~(((size_t *)s->bitmap)[w] | ((size_t *)s->reserved)[w]) & valid_bits(s, w);
+}
+
+/** Bring the summary bit of bitmap word w up to date. */
+static void update_word(bitmap_summary *s, uint32_t w)
+{
+	size_t mask = (size_t)1 << (w % bits_per_word);
+	if (free_bits(s, w) != 0) {
+		s->nonfull[w / bits_per_word] |= mask;
+	} else {
+		s->nonfull[w / bits_per_word] &= ~mask;
+	}
+}
+
+/** Get the region that a bit of the bitmap is in. */
+static uint32_t bit_region(uint32_t index)
+{
+	return index / (bits_per_word * bits_per_word);
+}
+
+bool bitmap_summary_init(bitmap_summary *s, bitmap_t *b, uint32_t nbits)
+{
+	s->bitmap = b;
+	s->nbits = nbits;
+	s->nwords = div_round_up(nbits, bits_per_word);
+	s->nregions = div_round_up(s->nwords, bits_per_word);
+	s->nonfull = calloc(s->nregions, sizeof(size_t));
+	s->region_free = calloc(s->nregions, sizeof(uint32_t));
+	s->reserved = calloc(s->nwords, sizeof(size_t));
+	s->nreserved = 0;
+	if (s->nonfull == NULL || s->region_free == NULL || s->reserved == NULL) {
+		bitmap_summary_destroy(s);
+		return false;
+	}
+
+	for (uint32_t w = 0; w < s->nwords; ++w) {
+		update_word(s, w);
+		s->region_free[w / bits_per_word] += __builtin_popcountl(free_bits(s, w));
+	}
+	return true;
+}
+
+void bitmap_summary_destroy(bitmap_summary *s)
+{
+	free(s->nonfull);
+	free(s->region_free);
+	free(s->reserved);
+	s->nonfull = NULL;
+	s->region_free = NULL;
+	s->reserved = NULL;
+}
+
+/** Find the first bitmap word at or after w that has unused bits, or nwords if there is none. */
+static uint32_t next_nonfull_word(bitmap_summary *s, uint32_t w)
+{
+	if (w >= s->nwords) {
+		return s->nwords;
+	}
+	uint32_t r = w / bits_per_word;
+	size_t pending = s->nonfull[r] & (word_all_bits << (w % bits_per_word));
+	while (pending == 0) {
+		if (++r == s->nregions) {
+			return s->nwords;
+		}
+		pending = s->nonfull[r];
+	}
+	return (r * bits_per_word) + __builtin_ctzl(pending);
+}
+
+/**
+ * Mark count bits from start on, which must all be unused and not reserved, as in-use, or as
+ * reserved if reserve is set.
+ */
+static void mark_used(bitmap_summary *s, uint32_t start, uint32_t count, bool reserve)
+{
+	for (uint32_t index = start; index < start + count; ++index) {
+		assert(bitmap_summary_isfree(s, index));
+		bitmap_set(reserve ? s->reserved : s->bitmap, s->nbits, index, true);
+		s->region_free[bit_region(index)] -= 1;
+	}
+	if (reserve) {
+		s->nreserved += count;
+	}
+	for (uint32_t w = start / bits_per_word; w <= (start + count - 1) / bits_per_word; ++w) {
+		update_word(s, w);
+	}
+}
+
+int bitmap_summary_alloc(bitmap_summary *s, uint32_t start, uint32_t *index)
+{
+	if (start >= s->nbits) {
+		start = 0;
+	}
+
+	// The word holding start is the only one where bits before start are skipped; they are
+	// looked at again if the search has to wrap around
+	uint32_t w = start / bits_per_word;
+	size_t bits = free_bits(s, w) & (word_all_bits << (start % bits_per_word));
+	if (bits == 0) {
+		w = next_nonfull_word(s, w + 1);
+		if (w == s->nwords) {
+			w = next_nonfull_word(s, 0);
+		}
+		if (w == s->nwords) {
+			return -1;
+		}
+		bits = free_bits(s, w);
+	}
+
+	*index = (w * bits_per_word) + __builtin_ctzl(bits);
+	mark_used(s, *index, 1, false);
+	return 0;
+}
+
+/**
+ * Look for runs of unused bits within bits [from, to) like bitmap_find_run(), but skip full
+ * regions, and stretches of regions with too few unused bits to beat the longest run so far.
+ */
+static void find_run(bitmap_summary *s, uint32_t from, uint32_t to, uint32_t want,
+                     uint32_t *best_start, uint32_t *best_len)
+{
+	// Region boundaries are computed in 64 bits, as the last one can be past UINT32_MAX
+	const uint64_t region_bits = bits_per_word * bits_per_word;
+
+	for (uint32_t r = bit_region(from); from < to && *best_len < want; ) {
+		// Gather the stretch of regions up to the next full one
+		uint32_t stretch_free = 0;
+		uint32_t end = r;
+		while (end < s->nregions && end * region_bits < to && s->region_free[end] != 0) {
+			stretch_free += s->region_free[end];
+			end += 1;
+		}
+
+		uint32_t stretch_to = (end * region_bits < to) ? end * region_bits : to;
+		if (stretch_free > *best_len) {
+			bitmap_find_run(s->bitmap, s->reserved, from, stretch_to, want, best_start, best_len);
+		}
+
+		// Step over the full region that ended the stretch
+		r = end + 1;
+		if (r * region_bits >= to) {
+			break;
+		}
+		from = r * region_bits;
+	}
+}
+
+/** Find the run of bitmap_summary_alloc_range() and mark it as in-use or reserved. */
+static int alloc_range(bitmap_summary *s, uint32_t from, uint32_t want,
+                       uint32_t *start, uint32_t *got, bool reserve)
+{
+	assert(want > 0);
+
+	if (from >= s->nbits) {
+		from = 0;
+	}
+	*got = 0;
+	find_run(s, from, s->nbits, want, start, got);
+	// Runs that started before from and carried on past it were only seen in part
+	uint32_t wrap_to = (want < s->nbits - from) ? from + want : s->nbits;
+	find_run(s, 0, wrap_to, want, start, got);
+	if (*got == 0) {
+		return -1;
+	}
+
+	mark_used(s, *start, *got, reserve);
+	return 0;
+}
+
+int bitmap_summary_alloc_range(bitmap_summary *s, uint32_t from, uint32_t want,
+                               uint32_t *start, uint32_t *got)
+{
+	return alloc_range(s, from, want, start, got, false);
+}
+
+int bitmap_summary_reserve_range(bitmap_summary *s, uint32_t from, uint32_t want,
+                                 uint32_t *start, uint32_t *got)
+{
+	return alloc_range(s, from, want, start, got, true);
+}
+
+bool bitmap_summary_find_largest(bitmap_summary *s, uint32_t from, uint32_t to,
+                                 uint32_t *start, uint32_t *len)
+{
+	if (to > s->nbits) {
+		to = s->nbits;
+	}
+	*len = 0;
+	find_run(s, from, to, UINT32_MAX, start, len);
+	return *len != 0;
+}
+
+uint32_t bitmap_summary_count_free(bitmap_summary *s, uint32_t from, uint32_t to)
+{
+	const uint32_t region_bits = bits_per_word * bits_per_word;
+	uint32_t count = 0;
+
+	if (to > s->nbits) {
+		to = s->nbits;
+	}
+	// Whole regions and words are counted at once; only the bits at the edges one by one
+	while (from < to) {
+		if (from % region_bits == 0 && to - from >= region_bits) {
+			count += s->region_free[bit_region(from)];
+			from += region_bits;
+		} else if (from % bits_per_word == 0 && to - from >= bits_per_word) {
+			count += __builtin_popcountl(free_bits(s, from / bits_per_word));
+			from += bits_per_word;
+		} else {
+			count += bitmap_summary_isfree(s, from);
+			from += 1;
+		}
+	}
+	return count;
+}
+
+bool bitmap_summary_isfree(bitmap_summary *s, uint32_t index)
+{
+	return !bitmap_isset(s->bitmap, s->nbits, index) && !bitmap_isset(s->reserved, s->nbits, index);
+}
+
+void bitmap_summary_free(bitmap_summary *s, uint32_t index)
+{
+	bitmap_free(s->bitmap, s->nbits, index);
+	s->region_free[bit_region(index)] += 1;
+	update_word(s, index / bits_per_word);
+}
+
+void bitmap_summary_claim(bitmap_summary *s, uint32_t start, uint32_t count)
+{
+	// The bits were already left out of the unused counts when they were reserved
+	for (uint32_t index = start; index < start + count; ++index) {
+		bitmap_free(s->reserved, s->nbits, index);
+		bitmap_set(s->bitmap, s->nbits, index, true);
+	}
+	s->nreserved -= count;
+}
+
+void bitmap_summary_unreserve(bitmap_summary *s, uint32_t start, uint32_t count)
+{
+	for (uint32_t index = start; index < start + count; ++index) {
+		bitmap_free(s->reserved, s->nbits, index);
+		s->region_free[bit_region(index)] += 1;
+	}
+	for (uint32_t w = start / bits_per_word; count != 0 && w <= (start + count - 1) / bits_per_word; ++w) {
+		update_word(s, w);
+	}
+	s->nreserved -= count;
+}
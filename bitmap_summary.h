@@ -0,0 +1,111 @@
+/**
+ * CSC369 Assignment 4 - In-memory bitmap summary header file.
+ *
+ * Searching an on-disk bitmap for unused bits means looking at every word of
+ * it, including the long stretches that are already full on a busy image. The
+ * summary keeps a second level on top of the bitmap: one bit per bitmap word
+ * that is set if the word has any unused bits, and a count of unused bits for
+ * each region of bitmap words covered by one summary word. Searches only look
+ * at the bitmap words the summary points them to. It is built when the file
+ * system is mounted, and the bitmap must only be changed through the functions
+ * below while it is in use.
+ *
+ * Bits can also be reserved: they stay unused in the bitmap, so nothing about
+ * them reaches the disk, but searches treat them as in-use until they are
+ * either claimed (marked as in-use) or given back.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bitmap.h"
+
+/** Summary of a single bitmap. */
+typedef struct bitmap_summary {
+	/** The bitmap being summarized (in the mmap'd disk image). */
+	bitmap_t *bitmap;
+	/** Number of bits in the bitmap. */
+	uint32_t nbits;
+	/** Number of words in the bitmap. */
+	uint32_t nwords;
+	/** Number of regions; each covers as many bitmap words as a word has bits. */
+	uint32_t nregions;
+	/** One bit per bitmap word, set if the word has unused bits that aren't reserved. */
+	size_t *nonfull;
+	/** Number of unused bits in each region, not counting reserved ones. */
+	uint32_t *region_free;
+	/** Bits that are reserved, laid out like the bitmap (in memory only). */
+	bitmap_t *reserved;
+	/** Number of reserved bits. */
+	uint32_t nreserved;
+} bitmap_summary;
+
+/**
+ * Build the summary of a bitmap.
+ *
+ * @param s      pointer to the summary to initialize.
+ * @param b      pointer to the bitmap.
+ * @param nbits  number of bits in the bitmap.
+ * @return       true on success; false if out of memory.
+ */
+bool bitmap_summary_init(bitmap_summary *s, bitmap_t *b, uint32_t nbits);
+
+/** Free the memory used by a summary. */
+void bitmap_summary_destroy(bitmap_summary *s);
+
+/**
+ * Find the first unused bit at or after start, wrapping around to the
+ * beginning, mark it as in-use and return its index in *index.
+ *
+ * @return  0 on success; -1 if all bits are already marked as in-use.
+ */
+int bitmap_summary_alloc(bitmap_summary *s, uint32_t start, uint32_t *index);
+
+/**
+ * Find a run of want unused bits, starting the search at bit from and wrapping
+ * around to the beginning, or the longest run of unused bits if there is no
+ * such run. A run that starts before from and carries on past it counts in
+ * full. The run is cut off at want bits, its bits are marked as in-use, and its
+ * first index and number of bits are returned in *start and *got. This is
+ * bitmap_alloc_range() over the summary.
+ *
+ * @return  0 on success; -1 if all bits are already marked as in-use.
+ */
+int bitmap_summary_alloc_range(bitmap_summary *s, uint32_t from, uint32_t want,
+                               uint32_t *start, uint32_t *got);
+
+/**
+ * Find the longest run of unused bits within bits [from, to), without marking
+ * them as in-use.
+ *
+ * @return  true if a run was found, with its first index and length in
+ *          *start and *len; false if all the bits are in-use.
+ */
+bool bitmap_summary_find_largest(bitmap_summary *s, uint32_t from, uint32_t to,
+                                 uint32_t *start, uint32_t *len);
+
+/** Count the unused bits within bits [from, to) that aren't reserved. */
+uint32_t bitmap_summary_count_free(bitmap_summary *s, uint32_t from, uint32_t to);
+
+/** Check if the bit at the given index is unused and not reserved. */
+bool bitmap_summary_isfree(bitmap_summary *s, uint32_t index);
+
+/** Mark the bit at the given index, which must be in-use, as unused. */
+void bitmap_summary_free(bitmap_summary *s, uint32_t index);
+
+/**
+ * Like bitmap_summary_alloc_range(), but reserve the bits of the run instead
+ * of marking them as in-use.
+ *
+ * @return  0 on success; -1 if all bits are already in-use or reserved.
+ */
+int bitmap_summary_reserve_range(bitmap_summary *s, uint32_t from, uint32_t want,
+                                 uint32_t *start, uint32_t *got);
+
+/** Mark count reserved bits from start on as in-use. */
+void bitmap_summary_claim(bitmap_summary *s, uint32_t start, uint32_t count);
+
+/** Give back count reserved bits from start on, which become unused again. */
+void bitmap_summary_unreserve(bitmap_summary *s, uint32_t start, uint32_t count);
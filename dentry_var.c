@@ -0,0 +1,93 @@
+/**
+ * CSC369 Assignment 4 - Variable length directory entry helpers.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "dentry_var.h"
+
+/** Number of bytes of a record that are taken up by its entry. */
+static uint32_t used_len(vsfs_dentry_var *rec)
+{
+	return (rec->ino == VSFS_INO_MAX) ? 0 : VSFS_DENTRY_VAR_LEN(rec->name_len);
+}
+
+void dentry_var_init_block(void *block)
+{
+	memset(block, 0, VSFS_BLOCK_SIZE);
+	vsfs_dentry_var *rec = dentry_var_at(block, 0);
+	rec->ino = VSFS_INO_MAX;
+	rec->rec_len = VSFS_BLOCK_SIZE;
+}
+
+uint32_t dentry_var_free_space(void *block)
+{
+	uint32_t max_free = 0;
+	for (uint32_t offset = 0; offset < VSFS_BLOCK_SIZE; ) {
+		vsfs_dentry_var *rec = dentry_var_at(block, offset);
+		uint32_t free_len = rec->rec_len - used_len(rec);
+		if (free_len > max_free) {
+			max_free = free_len;
+		}
+		offset += rec->rec_len;
+	}
+	return (max_free >= VSFS_DENTRY_VAR_LEN(1)) ? max_free : 0;
+}
+
+uint32_t dentry_var_find_space(void *block, uint32_t len)
+{
+	for (uint32_t offset = 0; offset < VSFS_BLOCK_SIZE; ) {
+		vsfs_dentry_var *rec = dentry_var_at(block, offset);
+		if (rec->rec_len - used_len(rec) >= len) {
+			return offset;
+		}
+		offset += rec->rec_len;
+	}
+	return VSFS_BLOCK_SIZE;
+}
+
+uint32_t dentry_var_add(void *block, uint32_t offset, vsfs_ino_t ino, const char *name)
+{
+	uint32_t name_len = strlen(name);
+	vsfs_dentry_var *rec = dentry_var_at(block, offset);
+	assert(rec->rec_len - used_len(rec) >= VSFS_DENTRY_VAR_LEN(name_len));
+
+	// Split the free space off the end of a used record
+	if (rec->ino != VSFS_INO_MAX) {
+		uint32_t rec_used = used_len(rec);
+		uint32_t new_offset = offset + rec_used;
+		vsfs_dentry_var *new_rec = dentry_var_at(block, new_offset);
+		new_rec->rec_len = rec->rec_len - rec_used;
+		rec->rec_len = rec_used;
+		offset = new_offset;
+		rec = new_rec;
+	}
+
+	rec->ino = ino;
+	rec->name_len = name_len;
+	memcpy(rec->name, name, name_len + 1);
+	return offset;
+}
+
+void dentry_var_remove(void *block, uint32_t offset)
+{
+	vsfs_dentry_var *rec = dentry_var_at(block, offset);
+	if (offset == 0) {
+		rec->ino = VSFS_INO_MAX;
+		return;
+	}
+
+	uint32_t prev_offset = 0;
+	while (prev_offset + dentry_var_at(block, prev_offset)->rec_len != offset) {
+		prev_offset += dentry_var_at(block, prev_offset)->rec_len;
+		assert(prev_offset < offset);
+	}
+	dentry_var_at(block, prev_offset)->rec_len += rec->rec_len;
+}
+
+bool dentry_var_block_empty(void *block)
+{
+	vsfs_dentry_var *rec = dentry_var_at(block, 0);
+	return rec->ino == VSFS_INO_MAX && rec->rec_len == VSFS_BLOCK_SIZE;
+}
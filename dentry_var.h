@@ -0,0 +1,55 @@
+/**
+ * CSC369 Assignment 4 - Variable length directory entry helpers header file.
+ *
+ * Functions for working with the records in a single directory block of a
+ * directory that uses variable length entries (see vsfs_dentry_var in
+ * vsfs.h). Offsets are byte offsets of records from the start of the block.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "vsfs.h"
+
+/** Get the record at the given offset in a directory block. */
+static inline vsfs_dentry_var *dentry_var_at(void *block, uint32_t offset)
+{
+	return (vsfs_dentry_var *)(block + offset);
+}
+
+/** Initialize a directory block to a single unused record covering all of it. */
+void dentry_var_init_block(void *block);
+
+/**
+ * Get the size of the largest record that can be added to a directory block,
+ * or 0 if not even an entry with a one character name fits.
+ */
+uint32_t dentry_var_free_space(void *block);
+
+/**
+ * Find a record in a directory block with enough free space for a new record
+ * of len bytes.
+ *
+ * @return  offset of the record; VSFS_BLOCK_SIZE if there is none.
+ */
+uint32_t dentry_var_find_space(void *block, uint32_t len);
+
+/**
+ * Add an entry using the free space of the record at the given offset, as
+ * returned by dentry_var_find_space(). An unused record is taken over; a used
+ * record has its free space split off into the new record.
+ *
+ * @return  offset of the new entry's record.
+ */
+uint32_t dentry_var_add(void *block, uint32_t offset, vsfs_ino_t ino, const char *name);
+
+/**
+ * Remove the entry at the given offset by merging its record into the one
+ * before it, or marking it unused if it is the first record in the block.
+ */
+void dentry_var_remove(void *block, uint32_t offset);
+
+/** Check if a directory block has no entries left. */
+bool dentry_var_block_empty(void *block);
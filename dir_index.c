@@ -0,0 +1,150 @@
+/**
+ * CSC369 Assignment 4 - In-memory directory name index implementation.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dir_index.h"
+
+/** Smallest number of buckets in a table. */
+#define DIR_INDEX_MIN_CAPACITY 64
+
+uint32_t dir_name_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; ++c) {
+		hash ^= *c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/** Get the name stored in the directory entry that the index entry points to. */
+static const char *entry_name(dir_index *idx, dir_index_entry *entry)
+{
+	void *block_head = idx->image + (size_t)entry->blk * VSFS_BLOCK_SIZE;
+	if (idx->var_len) {
+		return ((vsfs_dentry_var *)(block_head + entry->slot))->name;
+	}
+	return ((vsfs_dentry *)block_head)[entry->slot].name;
+}
+
+/** Allocate a bucket array with all buckets marked unused. */
+static dir_index_entry *alloc_buckets(uint32_t capacity)
+{
+	dir_index_entry *buckets = malloc(capacity * sizeof(dir_index_entry));
+	if (buckets == NULL) {
+		return NULL;
+	}
+	for (uint32_t i = 0; i < capacity; ++i) {
+		buckets[i].ino = VSFS_INO_MAX;
+	}
+	return buckets;
+}
+
+/** Place an entry into the first unused bucket of its probe sequence. */
+static void place_entry(dir_index_entry *buckets, uint32_t capacity, const dir_index_entry *entry)
+{
+	uint32_t mask = capacity - 1;
+	uint32_t i = entry->hash & mask;
+	while (buckets[i].ino != VSFS_INO_MAX) {
+		i = (i + 1) & mask;
+	}
+	buckets[i] = *entry;
+}
+
+bool dir_index_init(dir_index *idx, void *image, bool var_len, uint32_t capacity)
+{
+	idx->image = image;
+	idx->var_len = var_len;
+	idx->count = 0;
+	idx->capacity = DIR_INDEX_MIN_CAPACITY;
+	// Keep the table at most half full
+	while (idx->capacity < capacity * 2) {
+		idx->capacity *= 2;
+	}
+	idx->buckets = alloc_buckets(idx->capacity);
+	return idx->buckets != NULL;
+}
+
+void dir_index_destroy(dir_index *idx)
+{
+	free(idx->buckets);
+	idx->buckets = NULL;
+	idx->capacity = 0;
+	idx->count = 0;
+}
+
+bool dir_index_reserve(dir_index *idx, uint32_t n)
+{
+	if (n * 2 <= idx->capacity) {
+		return true;
+	}
+
+	uint32_t capacity = idx->capacity;
+	while (capacity < n * 2) {
+		capacity *= 2;
+	}
+	dir_index_entry *buckets = alloc_buckets(capacity);
+	if (buckets == NULL) {
+		return false;
+	}
+	for (uint32_t i = 0; i < idx->capacity; ++i) {
+		if (idx->buckets[i].ino != VSFS_INO_MAX) {
+			place_entry(buckets, capacity, &idx->buckets[i]);
+		}
+	}
+	free(idx->buckets);
+	idx->buckets = buckets;
+	idx->capacity = capacity;
+	return true;
+}
+
+void dir_index_insert(dir_index *idx, const char *name, vsfs_ino_t ino,
+                      vsfs_blk_t blk, uint32_t lblk, uint32_t slot)
+{
+	assert((idx->count + 1) * 2 <= idx->capacity);
+	dir_index_entry entry = {
+		.hash = dir_name_hash(name),
+		.ino  = ino,
+		.blk  = blk,
+		.lblk = lblk,
+		.slot = slot,
+	};
+	place_entry(idx->buckets, idx->capacity, &entry);
+	idx->count += 1;
+}
+
+dir_index_entry *dir_index_find(dir_index *idx, const char *name)
+{
+	uint32_t hash = dir_name_hash(name);
+	uint32_t mask = idx->capacity - 1;
+	for (uint32_t i = hash & mask; idx->buckets[i].ino != VSFS_INO_MAX; i = (i + 1) & mask) {
+		dir_index_entry *entry = &idx->buckets[i];
+		if (entry->hash == hash && strcmp(entry_name(idx, entry), name) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+void dir_index_remove(dir_index *idx, dir_index_entry *entry)
+{
+	uint32_t mask = idx->capacity - 1;
+	uint32_t hole = entry - idx->buckets;
+	assert(hole < idx->capacity && entry->ino != VSFS_INO_MAX);
+
+	// Backward shift deletion: move any following entries of the same probe
+	// run into the hole so that lookups never stop early.
+	for (uint32_t i = (hole + 1) & mask; idx->buckets[i].ino != VSFS_INO_MAX; i = (i + 1) & mask) {
+		uint32_t home = idx->buckets[i].hash & mask;
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			idx->buckets[hole] = idx->buckets[i];
+			hole = i;
+		}
+	}
+	idx->buckets[hole].ino = VSFS_INO_MAX;
+	idx->count -= 1;
+}
@@ -0,0 +1,95 @@
+/**
+ * CSC369 Assignment 4 - In-memory directory name index header file.
+ *
+ * The root directory is stored on disk as an unsorted array of fixed size
+ * directory entries, so finding a name requires scanning every directory
+ * block. The index maps each name to the location of its directory entry so
+ * that lookups cost a single hash probe instead. It is built when the file
+ * system is mounted and must be kept in sync whenever an entry is added to or
+ * removed from the directory.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "vsfs.h"
+
+/** Location of a single directory entry. */
+typedef struct dir_index_entry {
+	/** Hash of the entry name (see dir_name_hash()). */
+	uint32_t hash;
+	/** Inode number; VSFS_INO_MAX marks an unused bucket. */
+	vsfs_ino_t ino;
+	/** Block number of the directory block holding the entry. */
+	vsfs_blk_t blk;
+	/** Index of that block within the directory (0 is i_direct[0]). */
+	uint32_t lblk;
+	/**
+	 * Index of the entry within the directory block, or for variable length
+	 * entries, the byte offset of its record in the block.
+	 */
+	uint32_t slot;
+} dir_index_entry;
+
+/** Open addressing hash table of directory entries. */
+typedef struct dir_index {
+	/** Pointer to the start of the mmap'd disk image, used to read names. */
+	void *image;
+	/** Whether the directory uses variable length entries (vsfs_dentry_var). */
+	bool var_len;
+	/** Bucket array; the number of buckets is always a power of 2. */
+	dir_index_entry *buckets;
+	/** Number of buckets. */
+	uint32_t capacity;
+	/** Number of used buckets. */
+	uint32_t count;
+} dir_index;
+
+/**
+ * Hash a file name (FNV-1a). Also selects the bucket of an entry in a hashed
+ * root directory, so it is part of the on-disk format and must not change.
+ */
+uint32_t dir_name_hash(const char *name);
+
+/**
+ * Initialize an empty index.
+ *
+ * @param idx       pointer to the index to initialize.
+ * @param image     pointer to the start of the mmap'd disk image.
+ * @param var_len   whether the directory uses variable length entries.
+ * @param capacity  expected number of entries.
+ * @return          true on success; false if memory allocation failed.
+ */
+bool dir_index_init(dir_index *idx, void *image, bool var_len, uint32_t capacity);
+
+/** Release all memory held by the index. */
+void dir_index_destroy(dir_index *idx);
+
+/**
+ * Make sure that at least n entries can be stored without growing the table,
+ * so that a following dir_index_insert() cannot fail.
+ *
+ * @return  true on success; false if memory allocation failed.
+ */
+bool dir_index_reserve(dir_index *idx, uint32_t n);
+
+/**
+ * Add an entry to the index. The directory entry itself must already be
+ * written to the directory block, and space must have been reserved with
+ * dir_index_reserve().
+ */
+void dir_index_insert(dir_index *idx, const char *name, vsfs_ino_t ino,
+                      vsfs_blk_t blk, uint32_t lblk, uint32_t slot);
+
+/**
+ * Find the entry with the given name.
+ *
+ * @return  pointer to the entry; NULL if there is no such name. The pointer
+ *          is only valid until the next insert or remove.
+ */
+dir_index_entry *dir_index_find(dir_index *idx, const char *name);
+
+/** Remove an entry previously returned by dir_index_find(). */
+void dir_index_remove(dir_index *idx, dir_index_entry *entry);
@@ -16,7 +16,126 @@
  * CSC369 Assignment 4 - File system runtime context implementation.
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "fs_ctx.h"
+#include "dentry_var.h"
+
+/** Directory entry slots of a block must fit into the free slot bit masks. */
+static_assert(VSFS_BLOCK_SIZE / sizeof(vsfs_dentry) <= sizeof(uint32_t) * CHAR_BIT,
+              "too many directory entries per block");
+
+/**
+ * Add all the directory entries in the given root directory block to the
+ * root directory name index and record which of its slots are free.
+ *
+ * @param fs    pointer to the context being initialized.
+ * @param blk   block number of the directory block.
+ * @param lblk  index of the block within the root directory.
+ * @return      true on success; false if memory allocation failed.
+ */
+static bool index_dentry_block(fs_ctx *fs, vsfs_blk_t blk, uint32_t lblk)
+{
+	vsfs_dentry *block_head = (vsfs_dentry *)fs_block(fs, blk);
+	for (uint32_t slot = 0; slot < fs->num_d_db; ++slot) {
+		if (block_head[slot].ino == VSFS_INO_MAX) {
+			continue;
+		}
+		fs->root_free_slots[lblk] &= ~((uint32_t)1 << slot);
+		if (!dir_index_reserve(&fs->root_index, fs->root_index.count + 1)) {
+			return false;
+		}
+		dir_index_insert(&fs->root_index, block_head[slot].name,
+		                 block_head[slot].ino, blk, lblk, slot);
+	}
+	return true;
+}
+
+/**
+ * Add all the entries in the given variable length root directory block to
+ * the root directory name index and record the largest free space in it.
+ *
+ * @param fs    pointer to the context being initialized.
+ * @param blk   block number of the directory block.
+ * @param lblk  index of the block within the root directory.
+ * @return      true on success; false if memory allocation failed.
+ */
+static bool index_dentry_var_block(fs_ctx *fs, vsfs_blk_t blk, uint32_t lblk)
+{
+	void *block = fs_block(fs, blk);
+	for (uint32_t offset = 0; offset < VSFS_BLOCK_SIZE; ) {
+		vsfs_dentry_var *rec = dentry_var_at(block, offset);
+		if (rec->ino != VSFS_INO_MAX) {
+			if (!dir_index_reserve(&fs->root_index, fs->root_index.count + 1)) {
+				return false;
+			}
+			dir_index_insert(&fs->root_index, rec->name, rec->ino, blk, lblk, offset);
+		}
+		offset += rec->rec_len;
+	}
+	fs->root_free_slots[lblk] = dentry_var_free_space(block);
+	return true;
+}
+
+/** Index a root directory block in whichever entry format the directory uses. */
+static bool index_root_block(fs_ctx *fs, vsfs_blk_t blk, uint32_t lblk)
+{
+	if (fs->var_len_dir) {
+		return index_dentry_var_block(fs, blk, lblk);
+	}
+	return index_dentry_block(fs, blk, lblk);
+}
+
+/**
+ * Build the name index and the free slot masks of the root directory by
+ * reading every directory block referenced by the root inode's direct and
+ * indirect pointers.
+ *
+ * @param fs  pointer to the context being initialized.
+ * @return    true on success; false if memory allocation failed.
+ */
+static bool index_root_directory(fs_ctx *fs)
+{
+	vsfs_inode *root_inode = fs_inode(fs, VSFS_ROOT_INO);
+
+	if (!dir_index_init(&fs->root_index, fs->image, fs->var_len_dir,
+	                    root_inode->i_blocks * fs->num_d_db)) {
+		return false;
+	}
+
+	fs->root_free_slots = malloc(fs->root_max_blocks * sizeof(uint32_t));
+	if (fs->root_free_slots == NULL) {
+		return false;
+	}
+	for (uint32_t i = 0; i < fs->root_max_blocks; ++i) {
+		fs->root_free_slots[i] = fs->var_len_dir ? VSFS_BLOCK_SIZE : fs->dentry_slots_mask;
+	}
+
+	for (uint32_t i = 0; i < VSFS_NUM_DIRECT; ++i) {
+		if (root_inode->i_direct[i] != VSFS_BLK_UNASSIGNED &&
+		    !index_root_block(fs, root_inode->i_direct[i], i)) {
+			return false;
+		}
+	}
+
+	if (root_inode->i_indirect != VSFS_BLK_UNASSIGNED) {
+		vsfs_blk_t *indirect = (vsfs_blk_t *)fs_block(fs, root_inode->i_indirect);
+		for (uint32_t i = 0; i < fs->num_blk_per_b; ++i) {
+			if (indirect[i] != VSFS_BLK_UNASSIGNED &&
+			    !index_root_block(fs, indirect[i], VSFS_NUM_DIRECT + i)) {
+				return false;
+			}
+		}
+	}
+
+	fs->root_free_hint = 0;
+	while (fs->root_free_hint < fs->root_max_blocks &&
+	       fs->root_free_slots[fs->root_free_hint] == 0) {
+		fs->root_free_hint += 1;
+	}
+	return true;
+}
 
 /**
  * Initialize file system context.
@@ -48,23 +167,87 @@ bool fs_ctx_init(fs_ctx *fs, void *image, size_t size)
 	if (fs->sb->sb_magic != VSFS_MAGIC) {
 		return false;
 	}
+
+	/** Refuse to mount images that use format features we don't know about. */
+	if ((fs->sb->sb_flags & ~VSFS_SB_KNOWN_FLAGS) != 0) {
+		return false;
+	}
 	
+	/** Number of inode and data bitmap blocks. Unless the superblock
+	 *  describes them, there is one of each at a fixed block number.
+	 */
+	uint64_t imap_blocks = 1;
+	uint64_t dmap_blocks = 1;
+	if ((fs->sb->sb_flags & VSFS_SB_MULTI_BITMAP) != 0) {
+		imap_blocks = fs->sb->sb_imap_blocks;
+		dmap_blocks = fs->sb->sb_dmap_blocks;
+	}
+	/** Inode slots are larger than an inode if they can hold inline data. */
+	fs->inode_size = sizeof(vsfs_inode);
+	fs->inline_max = 0;
+	if ((fs->sb->sb_flags & VSFS_SB_INLINE_DATA) != 0) {
+		uint32_t inode_size = fs->sb->sb_inode_size;
+		if (inode_size <= sizeof(vsfs_inode) || inode_size > VSFS_INODE_SIZE_MAX ||
+		    (inode_size & (inode_size - 1)) != 0) {
+			return false;
+		}
+		fs->inode_size = inode_size;
+		fs->inline_max = VSFS_INODE_INLINE_MAX(inode_size);
+	}
+	fs->inodes_per_block = VSFS_BLOCK_SIZE / fs->inode_size;
+
+	uint64_t bits_per_block = VSFS_BLOCK_SIZE * CHAR_BIT;
+	uint32_t inodes_per_block = fs->inodes_per_block;
+	uint64_t itable_blocks = div_round_up(fs->sb->sb_num_inodes, inodes_per_block);
+
+	/** Block groups, each starting with the inode table slice of its inodes
+	 *  (except group 0, where the slice follows the bitmaps).
+	 */
+	fs->blocks_per_group = 0;
+	fs->inodes_per_group = 0;
+	fs->num_groups = 0;
+	if ((fs->sb->sb_flags & VSFS_SB_BLOCK_GROUPS) != 0) {
+		vsfs_blk_t blocks_per_group = fs->sb->sb_blocks_per_group;
+		uint32_t inodes_per_group = fs->sb->sb_inodes_per_group;
+		if ((fs->sb->sb_flags & VSFS_SB_MULTI_BITMAP) == 0 || blocks_per_group == 0 ||
+		    inodes_per_group == 0 || inodes_per_group % inodes_per_block != 0) {
+			return false;
+		}
+		uint32_t num_groups = div_round_up(fs->sb->sb_num_blocks, blocks_per_group);
+		itable_blocks = inodes_per_group / inodes_per_block;
+		if ((uint64_t)num_groups * inodes_per_group != fs->sb->sb_num_inodes ||
+		    fs->sb->sb_data_region >= blocks_per_group ||
+		    (uint64_t)(num_groups - 1) * blocks_per_group + itable_blocks >= fs->sb->sb_num_blocks) {
+			return false;
+		}
+		fs->blocks_per_group = blocks_per_group;
+		fs->inodes_per_group = inodes_per_group;
+		fs->num_groups = num_groups;
+	}
+
+	if (fs->sb->sb_num_inodes > imap_blocks * bits_per_block ||
+	    fs->sb->sb_num_blocks > dmap_blocks * bits_per_block ||
+	    (uint64_t)fs->sb->sb_num_blocks * VSFS_BLOCK_SIZE > size ||
+	    VSFS_IMAP_BLKNUM + imap_blocks + dmap_blocks + itable_blocks > fs->sb->sb_data_region) {
+		return false;
+	}
+
 	/** VSFS Inode bitmap pointer 
 	 *  The block number of the inode bitmap is VSFS_IMAP_BLKNUM; 
 	 *  we multiply by the block size to get the offset in bytes from the 
          *  start of the mmap'd disk image.
 	 */ 
-	fs->ibmap = (bitmap_t *)(image + VSFS_IMAP_BLKNUM * VSFS_BLOCK_SIZE);
+	fs->ibmap = (bitmap_t *)fs_block(fs, VSFS_IMAP_BLKNUM);
 
 	/** VSFS Data block bitmap pointer
-	 *  Similar calculation as inode bitmap.
+	 *  The data bitmap follows the inode bitmap blocks.
 	 */
-	fs->dbmap = (bitmap_t *)(image + VSFS_DMAP_BLKNUM * VSFS_BLOCK_SIZE);
+	fs->dbmap = (bitmap_t *)fs_block(fs, VSFS_IMAP_BLKNUM + imap_blocks);
 
 	/** VSFS Inode table pointer
-	 *  Similar calculation as for bitmaps.
+	 *  The inode table (or the slice of group 0) follows the data bitmap blocks.
 	 */
-	fs->itable = (vsfs_inode *)(image + VSFS_ITBL_BLKNUM * VSFS_BLOCK_SIZE);
+	fs->itable = (vsfs_inode *)fs_block(fs, VSFS_IMAP_BLKNUM + imap_blocks + dmap_blocks);
 
 	// TODO: Initialize anything else that you add to the fs context.
 	
@@ -74,6 +257,61 @@ bool fs_ctx_init(fs_ctx *fs, void *image, size_t size)
 	/** Number of block numbers that can fit in a block */
 	fs->num_blk_per_b = div_round_up(VSFS_BLOCK_SIZE, sizeof(vsfs_blk_t));
 
+	/** Regular files are mapped with extents */
+	fs->extents = (fs->sb->sb_flags & VSFS_SB_EXTENTS) != 0;
+
+	/** Maximum number of blocks in the root directory */
+	fs->root_max_blocks = VSFS_NUM_DIRECT + fs->num_blk_per_b;
+
+	/** Maximum number of data blocks in a regular file. Block pointers reach
+	 *  further through the double indirect block. Extents can map any block
+	 *  number, so only the number of extents limits such files.
+	 */
+	fs->max_file_blocks = fs->extents ? UINT32_MAX :
+		fs->root_max_blocks + fs->num_blk_per_b * fs->num_blk_per_b;
+
+	/** A hashed root directory is looked up on disk */
+	fs->hashed_dir = (fs->sb->sb_flags & VSFS_SB_HASHED_DIR) != 0;
+
+	/** The bucket chains of a hashed root directory also use its double indirect block */
+	if (fs->hashed_dir) {
+		fs->root_max_blocks += fs->num_blk_per_b * fs->num_blk_per_b;
+	}
+
+	/** No files are open yet */
+	memset(fs->map_caches, 0, sizeof(fs->map_caches));
+
+	/** Bit mask with one bit set for each entry slot in a directory block */
+	fs->dentry_slots_mask = (uint32_t)(((uint64_t)1 << fs->num_d_db) - 1);
+
+	/** Statistics are only printed on request */
+	fs->frag_stats = false;
+
+	/** Allocation searches start at the first inode and the first data block */
+	fs->ibmap_cursor = 0;
+	fs->dbmap_cursor = fs->sb->sb_data_region;
+
+	/** Root directory entries are variable length records */
+	fs->var_len_dir = (fs->sb->sb_flags & VSFS_SB_VARLEN_DIR) != 0;
+	if (fs->hashed_dir && fs->var_len_dir) {
+		return false;
+	}
+
+	/** Summaries of the inode and data bitmaps */
+	if (!bitmap_summary_init(&fs->ibmap_summary, fs->ibmap, fs->sb->sb_num_inodes)) {
+		return false;
+	}
+	if (!bitmap_summary_init(&fs->dbmap_summary, fs->dbmap, fs->sb->sb_num_blocks)) {
+		bitmap_summary_destroy(&fs->ibmap_summary);
+		return false;
+	}
+
+	/** Name index and free slot masks of the root directory */
+	if (!fs->hashed_dir && !index_root_directory(fs)) {
+		fs_ctx_destroy(fs);
+		return false;
+	}
+
 	return true;
 }
 
@@ -87,5 +325,17 @@ bool fs_ctx_init(fs_ctx *fs, void *image, size_t size)
 void fs_ctx_destroy(fs_ctx *fs)
 {
 	//TODO: cleanup any other resources allocated in fs_ctx_init()
-	(void)fs;
+	dir_index_destroy(&fs->root_index);
+	free(fs->root_free_slots);
+	fs->root_free_slots = NULL;
+	bitmap_summary_destroy(&fs->ibmap_summary);
+	bitmap_summary_destroy(&fs->dbmap_summary);
+	for (uint32_t bucket = 0; bucket < VSFS_MAP_CACHE_BUCKETS; ++bucket) {
+		while (fs->map_caches[bucket] != NULL) {
+			block_map_cache *map = fs->map_caches[bucket];
+			fs->map_caches[bucket] = map->next;
+			free(map->blocks);
+			free(map);
+		}
+	}
 }
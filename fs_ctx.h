@@ -25,6 +25,49 @@
 #include "options.h"
 #include "vsfs.h"
 #include "bitmap.h"
+#include "bitmap_summary.h"
+#include "dir_index.h"
+
+/**
+ * Block map of a regular file that is open: the block number of each of its
+ * blocks, filled in as they are looked up (0, which is never a data block,
+ * if not yet). It is shared by all the open files of the inode, and the
+ * entries past the end of file are cleared whenever the file shrinks.
+ */
+typedef struct block_map_cache {
+	/** Inode number of the file. */
+	vsfs_ino_t ino;
+	/** Number of open files using the cache. */
+	uint32_t refs;
+	/** Number of elements in blocks. */
+	uint32_t size;
+	/** Block number of each block of the file, indexed by its position. */
+	vsfs_blk_t *blocks;
+	/**
+	 * Blocks reserved ahead of appends to the file: the first one, which
+	 * follows the file's last block on disk, and the number of them. They
+	 * are only reserved in dbmap_summary, so they stay free on disk until
+	 * an append maps them into the file, and nothing leaks if the file
+	 * system isn't unmounted cleanly. They are given back when the last
+	 * open file of the inode is released, or when they are needed elsewhere.
+	 */
+	vsfs_blk_t prealloc_start;
+	uint32_t prealloc_len;
+	/** Number of blocks to reserve ahead of the next append; 0 until the first. */
+	uint32_t prealloc_next;
+	/** Next cache in the same hash bucket. */
+	struct block_map_cache *next;
+} block_map_cache;
+
+/** Number of hash buckets of block map caches in fs_ctx. */
+#define VSFS_MAP_CACHE_BUCKETS 64
+
+/**
+ * Smallest and largest number of blocks reserved ahead of appends to an open
+ * file (see block_map_cache). It doubles each time it runs out.
+ */
+#define VSFS_PREALLOC_MIN 8
+#define VSFS_PREALLOC_MAX 1024
 
 /**
  * Mounted file system runtime state - "fs context".
@@ -34,13 +77,18 @@ typedef struct fs_ctx {
 	void *image;
 	/** Image size in bytes. */
 	size_t size;
+	/**
+	 * Descriptor of the image file, for I/O that goes around the mapping.
+	 * It shares the page cache with the mapping, so both see the same data.
+	 */
+	int image_fd;
 	/** Pointer to the superblock in the mmap'd disk image */
 	vsfs_superblock *sb;
 	/** Pointer to the inode bitmap in the mmap'd disk image */
 	bitmap_t *ibmap;
 	/** Pointer to the data block bitmap in the mmap'd disk image */
 	bitmap_t *dbmap;
-	/** Pointer to the inode table in the mmap'd disk image */
+	/** Pointer to the inode table (of group 0, with block groups) in the mmap'd disk image */
 	vsfs_inode *itable;
 	
 	//TODO: other useful runtime state of the mounted file system should be
@@ -52,8 +100,116 @@ typedef struct fs_ctx {
 	/** Number of block numbers that can fit in a block */
 	uint32_t num_blk_per_b;
 
+	/**
+	 * Whether the root directory uses the hashed on-disk format. If so, its
+	 * entries are looked up on disk, and the name index and free slot masks
+	 * below are not used.
+	 */
+	bool hashed_dir;
+
+	/**
+	 * Whether the root directory uses variable length entries
+	 * (vsfs_dentry_var) instead of fixed size vsfs_dentry slots.
+	 */
+	bool var_len_dir;
+
+	/** Size of an inode slot in the inode table, and the number of slots in a block. */
+	uint32_t inode_size;
+	uint32_t inodes_per_block;
+
+	/**
+	 * Largest regular file that keeps its data in the inode, or 0 if the
+	 * image has no inline data (VSFS_SB_INLINE_DATA).
+	 */
+	uint32_t inline_max;
+
+	/** Whether regular files map their data with extents (VSFS_SB_EXTENTS). */
+	bool extents;
+
+	/** Name index of the root directory entries */
+	dir_index root_index;
+
+	/** Maximum number of data blocks in a regular file */
+	uint32_t max_file_blocks;
+
+	/**
+	 * Maximum number of blocks in the root directory: direct + indirect, and
+	 * double indirect if it is hashed.
+	 */
+	uint32_t root_max_blocks;
+
+	/** Bit mask with one bit set for each entry slot in a directory block */
+	uint32_t dentry_slots_mask;
+
+	/**
+	 * Next-fit cursors: the inode and data bitmap searches start where the
+	 * previous allocation left off instead of rescanning from bit 0.
+	 */
+	uint32_t ibmap_cursor;
+	uint32_t dbmap_cursor;
+
+	/**
+	 * Number of blocks and inodes in a block group, and the number of groups.
+	 * All are 0 if the image has no block groups.
+	 */
+	vsfs_blk_t blocks_per_group;
+	uint32_t inodes_per_group;
+	uint32_t num_groups;
+
+	/** Summaries of the inode and data bitmaps, which are only changed through them */
+	bitmap_summary ibmap_summary;
+	bitmap_summary dbmap_summary;
+
+	/**
+	 * Free entry slots of each root directory block, indexed by the position
+	 * of the block in the root directory (0 is i_direct[0], VSFS_NUM_DIRECT
+	 * is the first block in the indirect block). Bit i is set if slot i is
+	 * free. Blocks that are not allocated have all bits set.
+	 *
+	 * For a variable length directory, each element is instead the size in
+	 * bytes of the largest record that fits into the block (0 if the block
+	 * is full, VSFS_BLOCK_SIZE if it is not allocated).
+	 */
+	uint32_t *root_free_slots;
+
+	/**
+	 * Position of the first root directory block that may have a free slot;
+	 * all blocks before it are full.
+	 */
+	uint32_t root_free_hint;
+
+	/** Block maps of the open regular files, hashed by inode number */
+	block_map_cache *map_caches[VSFS_MAP_CACHE_BUCKETS];
+
+	/** Print fragmentation statistics when unmounting (-o fragstats) */
+	bool frag_stats;
+
 } fs_ctx;
 
+/**
+ * Get a pointer to a block in the mmap'd disk image. The offset is computed in
+ * size_t, so that blocks past 4 GiB can be reached.
+ */
+static inline void *fs_block(fs_ctx *fs, vsfs_blk_t blk)
+{
+	return fs->image + (size_t)blk * VSFS_BLOCK_SIZE;
+}
+
+/**
+ * Get a pointer to an inode. With block groups, the inode table is split into
+ * a slice at the start of each group (after the bitmaps in group 0). Inodes
+ * are fs->inode_size bytes apart.
+ */
+static inline vsfs_inode *fs_inode(fs_ctx *fs, vsfs_ino_t ino)
+{
+	if (fs->inodes_per_group == 0) {
+		return (vsfs_inode *)((char *)fs->itable + (size_t)ino * fs->inode_size);
+	}
+	uint32_t group = ino / fs->inodes_per_group;
+	char *slice = (group == 0) ? (char *)fs->itable : fs_block(fs, group * fs->blocks_per_group);
+	return (vsfs_inode *)(slice + (size_t)(ino % fs->inodes_per_group) * fs->inode_size);
+}
+
 /**
  * Initialize file system context.
  *
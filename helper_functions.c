@@ -1,302 +1,1327 @@
 /** This file contains all of the helper functions used in vsfs.c. */
 #include "helper_functions.h"
 
-/** Get file system context. */
-fs_ctx *get_fs(void)
-{
-	return (fs_ctx*)fuse_get_context()->private_data;
-}
-
-/** 
- * Get the inode for the given path if it is in the directory array passed in
- * and return the number of valid data blocks read.
-*/
-uint32_t get_path_inode(uint32_t num_blocks, vsfs_blk_t *directory_entry_array, const char *path_name, vsfs_ino_t *ino) {
-	fs_ctx *fs = get_fs();
-	uint32_t array_index = 0;
-	uint32_t valid_blocks_found = 0;
-	while (array_index < num_blocks) {
-		if (directory_entry_array[array_index] != VSFS_BLK_UNASSIGNED) {
-			vsfs_dentry *block_head = (vsfs_dentry *)(fs->image + directory_entry_array[array_index] * VSFS_BLOCK_SIZE);
-			for (uint32_t array_entry_index = 0; array_entry_index < fs->num_d_db; ++array_entry_index) {
-				vsfs_dentry *curr_array_entry = &block_head[array_entry_index];
-				if (curr_array_entry->ino != VSFS_INO_MAX) {
-					char *curr_array_entry_name = curr_array_entry->name;
-					if (strcmp(curr_array_entry_name, path_name) == 0) {				
-						*ino = curr_array_entry->ino;
-						return valid_blocks_found;
-					}
-				}
+/** Check if the given inode maps its data with extents rather than block pointers. */
+static bool inode_has_extents(fs_ctx *fs, vsfs_inode *inode) {
+	return fs->extents && S_ISREG(inode->i_mode);
+}
+
+/** Check if the given inode keeps its file's data inline (see VSFS_INODE_INLINE_MAX). */
+static bool inode_is_inline(fs_ctx *fs, vsfs_inode *inode) {
+	return fs->inline_max != 0 && S_ISREG(inode->i_mode) && inode->i_blocks == 0 && inode->i_size > 0;
+}
+
+/** Get the inline data of the given inode, which takes the place of its block map. */
+static char *inode_inline_data(vsfs_inode *inode) {
+	return (char *)inode->i_direct;
+}
+
+/** Get the first block of a file that is mapped through the double indirect block. */
+static uint32_t double_indirect_first(fs_ctx *fs) {
+	return VSFS_NUM_DIRECT + fs->num_blk_per_b;
+}
+
+/** Get the number of indirect blocks listed in the double indirect block of a file with nblocks blocks. */
+static uint32_t double_indirect_count(fs_ctx *fs, uint32_t nblocks) {
+	uint32_t first = double_indirect_first(fs);
+	return (nblocks > first) ? div_round_up(nblocks - first, fs->num_blk_per_b) : 0;
+}
+
+/** Get the position of the first block past the one at lblk that is mapped by another indirect block. */
+static uint32_t next_map_boundary(fs_ctx *fs, uint32_t lblk) {
+	uint32_t double_first = double_indirect_first(fs);
+	if (lblk < VSFS_NUM_DIRECT) {
+		return VSFS_NUM_DIRECT;
+	}
+	if (lblk < double_first) {
+		return double_first;
+	}
+	return double_first + ((lblk - double_first) / fs->num_blk_per_b + 1) * fs->num_blk_per_b;
+}
+
+/** Get the extents of the given inode's file, wherever they are kept. */
+static vsfs_extent *inode_extents(fs_ctx *fs, vsfs_inode *inode) {
+	if (inode->i_num_extents > VSFS_INLINE_EXTENTS) {
+		return (vsfs_extent *)fs_block(fs, inode->i_extent_block);
+	}
+	return inode->i_extents;
+}
+
+/** Count the block numbers in an array of count of them that are assigned. */
+static uint32_t count_assigned(const vsfs_blk_t *block_numbers, uint32_t count) {
+	uint32_t assigned = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		assigned += (block_numbers[i] != VSFS_BLK_UNASSIGNED);
+	}
+	return assigned;
+}
+
+/** 
+ * Count the blocks that the given inode's file takes up: its data blocks, which holes don't have,
+ * and the blocks holding the rest of its block map (its indirect blocks or its extent block).
+ */
+static uint32_t inode_used_blocks(fs_ctx *fs, vsfs_inode *inode) {
+	if (!S_ISREG(inode->i_mode)) {
+		// The blocks of a hashed root directory need not be contiguous in the directory
+		uint32_t count = inode->i_blocks + ((inode->i_indirect != VSFS_BLK_UNASSIGNED) ? 1 : 0);
+		if (inode->i_double_indirect != VSFS_BLK_UNASSIGNED) {
+			count += 1 + count_assigned(fs_block(fs, inode->i_double_indirect), fs->num_blk_per_b);
+		}
+		return count;
+	}
+	// Without blocks, the block map may hold inline data instead
+	if (inode->i_blocks == 0) {
+		return 0;
+	}
+
+	if (inode_has_extents(fs, inode)) {
+		vsfs_extent *extents = inode_extents(fs, inode);
+		uint32_t count = (inode->i_num_extents > VSFS_INLINE_EXTENTS) ? 1 : 0;
+		for (uint32_t i = 0; i < inode->i_num_extents; ++i) {
+			count += extents[i].e_len;
+		}
+		return count;
+	}
+
+	uint32_t direct = (inode->i_blocks < VSFS_NUM_DIRECT) ? inode->i_blocks : VSFS_NUM_DIRECT;
+	uint32_t count = count_assigned(inode->i_direct, direct);
+	if (inode->i_blocks > VSFS_NUM_DIRECT && inode->i_indirect != VSFS_BLK_UNASSIGNED) {
+		count += 1 + count_assigned(fs_block(fs, inode->i_indirect), fs->num_blk_per_b);
+	}
+	if (inode->i_blocks > double_indirect_first(fs) && inode->i_double_indirect != VSFS_BLK_UNASSIGNED) {
+		vsfs_blk_t *indirect_blocks = (vsfs_blk_t *)fs_block(fs, inode->i_double_indirect);
+		count += 1;
+		for (uint32_t i = 0; i < double_indirect_count(fs, inode->i_blocks); ++i) {
+			if (indirect_blocks[i] != VSFS_BLK_UNASSIGNED) {
+				count += 1 + count_assigned(fs_block(fs, indirect_blocks[i]), fs->num_blk_per_b);
 			}
-			valid_blocks_found += 1;
 		}
-		array_index += 1;
 	}
-	*ino = VSFS_INO_MAX;
-	return valid_blocks_found;
+	return count;
 }
 
 /** 
- * Read all of the directory entries in the directory array passed in and
- * return the number of valid data blocks read.
+ * Fill in the attributes of the given inode that vsfs keeps (see vsfs_getattr()). st_blocks
+ * counts the blocks the file takes up, including the indirect, double indirect or extent blocks
+ * but not its holes.
  */
-int read_directory_entries(uint32_t num_blocks, vsfs_blk_t *directory_entry_array, void *buf, fuse_fill_dir_t filler) {
-	fs_ctx *fs = get_fs();
-	uint32_t array_index = 0;
-	int valid_blocks_found = 0;
-	while (array_index < num_blocks) {
-		if (directory_entry_array[array_index] != VSFS_BLK_UNASSIGNED) {
-			vsfs_dentry *block_head = (vsfs_dentry *)(fs->image + directory_entry_array[array_index] * VSFS_BLOCK_SIZE);
-			for (uint32_t array_entry_index = 0; array_entry_index < fs->num_d_db; ++array_entry_index) {
-				vsfs_dentry *curr_array_entry = &block_head[array_entry_index];
-				if (curr_array_entry->ino != VSFS_INO_MAX) {
-					uint32_t err = filler(buf, curr_array_entry->name, NULL, 0);
-					assert(!err);
-					if (err) {
-						return -ENOBUFS;
-					}
+void fill_inode_stat(fs_ctx *fs, vsfs_ino_t ino, struct stat *st) {
+	vsfs_inode *inode = fs_inode(fs, ino);
+
+	memset(st, 0, sizeof(*st));
+	st->st_ino = ino;
+	st->st_mode = inode->i_mode;
+	st->st_nlink = inode->i_nlink;
+	st->st_size = inode->i_size;
+	st->st_blocks = (blkcnt_t)inode_used_blocks(fs, inode) * (VSFS_BLOCK_SIZE / 512);
+	st->st_mtim = inode->i_mtime;
+}
+
+/** 
+ * Pass the root directory entries at or after the given readdir offset to filler, each with the
+ * offset to resume from after it. An entry's position in the directory is its block's index in
+ * the root directory times VSFS_BLOCK_SIZE plus its slot (for variable length entries, its record
+ * offset), and the offset following it is that position plus 1. Entries never move once added,
+ * so an offset stays valid while other entries are added or removed between calls. Returns 0 once
+ * the end of the directory is reached or filler reports that the buffer is full. Each entry's
+ * attributes are read from the inode table and passed along, so that listing a directory with
+ * its attributes doesn't cost a separate lookup per entry.
+ */
+int read_directory_entries(fs_ctx *fs, off_t offset, void *buf, fuse_fill_dir_t filler) {
+	uint32_t start_pos = offset % VSFS_BLOCK_SIZE;
+	struct stat st;
+
+	for (uint32_t lblk = offset / VSFS_BLOCK_SIZE; lblk < fs->root_max_blocks; ++lblk, start_pos = 0) {
+		vsfs_blk_t *block_number = root_dentry_block_number(fs, lblk);
+		if (block_number == NULL) {
+			// Skip the blocks the missing indirect block would have mapped
+			lblk = next_map_boundary(fs, lblk) - 1;
+			continue;
+		}
+		if (*block_number == VSFS_BLK_UNASSIGNED) {
+			continue;
+		}
+
+		void *block = fs_block(fs, *block_number);
+		off_t block_offset = (off_t)lblk * VSFS_BLOCK_SIZE + 1;
+		if (fs->var_len_dir) {
+			for (uint32_t pos = 0; pos < VSFS_BLOCK_SIZE; pos += dentry_var_at(block, pos)->rec_len) {
+				vsfs_dentry_var *rec = dentry_var_at(block, pos);
+				if (pos < start_pos || rec->ino == VSFS_INO_MAX) {
+					continue;
+				}
+				fill_inode_stat(fs, rec->ino, &st);
+				if (filler(buf, rec->name, &st, block_offset + pos)) {
+					return 0;
+				}
+			}
+		}
+		else {
+			vsfs_dentry *block_head = (vsfs_dentry *)block;
+			for (uint32_t slot = start_pos; slot < fs->num_d_db; ++slot) {
+				if (block_head[slot].ino == VSFS_INO_MAX) {
+					continue;
+				}
+				fill_inode_stat(fs, block_head[slot].ino, &st);
+				if (filler(buf, block_head[slot].name, &st, block_offset + slot)) {
+					return 0;
 				}
 			}
-			valid_blocks_found += 1;
-		}
-		array_index += 1;
-	}
-	return valid_blocks_found;
-}
-
-/** Find and return the next available block number in the root directory. */
-vsfs_blk_t next_available_dentry(uint32_t num_blocks, vsfs_blk_t *directory_entry_array, uint32_t *directory_array_index_output, uint32_t *index_within_array) {
-	fs_ctx *fs = get_fs();
-	uint32_t array_index = 0;
-	int valid_blocks_found = 0;
-	while (array_index < num_blocks) {
-		if (directory_entry_array[array_index] != VSFS_BLK_UNASSIGNED) {
-			vsfs_dentry *block_head = (vsfs_dentry *)(fs->image + directory_entry_array[array_index] * VSFS_BLOCK_SIZE);
-			for (uint32_t array_entry_index = 0; array_entry_index < fs->num_d_db; ++array_entry_index) {
-				vsfs_dentry *curr_array_entry = &block_head[array_entry_index];
-				if (curr_array_entry->ino == VSFS_INO_MAX) {
-					*directory_array_index_output = array_index;
-					*index_within_array = array_entry_index;
-					return valid_blocks_found;
+		}
+	}
+	return 0;
+}
+
+/** 
+ * Check if the input bitmap has any available space, and if so, set found_index to the next available
+ * block index from the input bitmap, searching from *cursor onwards. The cursor is moved past the
+ * allocated index.
+ */
+void allocate_bitmap_index(bitmap_summary *bitmap, uint32_t *cursor, uint32_t *found_index) {
+    int err = bitmap_summary_alloc(bitmap, *cursor, found_index);
+    assert(!err);
+    *cursor = *found_index + 1;
+}
+
+/** 
+ * Add the input directory entry to the input directory entry array and, unless the root
+ * directory is hashed, record it in the root directory name index and free slot masks.
+ * lblk is the index of the directory block within the root directory. For a variable length
+ * directory, dentry_array_index is the offset of the record whose free space is used.
+ */
+int add_entry_to_block(fs_ctx *fs, vsfs_dentry *add_to_array, uint32_t dentry_array_index, uint32_t lblk, vsfs_inode *new_file_inode, uint32_t inode_index, const char *path_name) {
+	vsfs_inode *root_inode = fs_inode(fs, VSFS_ROOT_INO);
+	vsfs_blk_t add_to_block = ((void *)add_to_array - fs->image) / VSFS_BLOCK_SIZE;
+
+	if (fs->var_len_dir) {
+		uint32_t offset = dentry_var_add(add_to_array, dentry_array_index, inode_index, path_name);
+		dir_index_insert(&fs->root_index, path_name, inode_index, add_to_block, lblk, offset);
+		fs->root_free_slots[lblk] = dentry_var_free_space(add_to_array);
+		root_inode->i_mtime = new_file_inode->i_mtime;
+		return 0;
+	}
+
+    vsfs_dentry *new_file_dentry = &add_to_array[dentry_array_index];
+    new_file_dentry->ino = inode_index;
+    strcpy(new_file_dentry->name, path_name);
+	if (!fs->hashed_dir) {
+		dir_index_insert(&fs->root_index, path_name, inode_index, add_to_block, lblk, dentry_array_index);
+		fs->root_free_slots[lblk] &= ~((uint32_t)1 << dentry_array_index);
+	}
+	root_inode->i_mtime = new_file_inode->i_mtime;
+    return 0;
+}
+
+/** 
+ * Get the indirect block that holds the block number of the block at position lblk (past the
+ * direct blocks) in the given inode's file, and set first to the position of the first block it
+ * maps. Returns VSFS_BLK_UNASSIGNED if there is no such indirect block yet.
+ */
+static vsfs_blk_t inode_indirect_block(fs_ctx *fs, vsfs_inode *inode, uint32_t lblk, uint32_t *first) {
+	uint32_t double_first = double_indirect_first(fs);
+
+	if (lblk < double_first) {
+		*first = VSFS_NUM_DIRECT;
+		return inode->i_indirect;
+	}
+	uint32_t index = (lblk - double_first) / fs->num_blk_per_b;
+	*first = double_first + index * fs->num_blk_per_b;
+	if (inode->i_double_indirect == VSFS_BLK_UNASSIGNED) {
+		return VSFS_BLK_UNASSIGNED;
+	}
+	return ((vsfs_blk_t *)fs_block(fs, inode->i_double_indirect))[index];
+}
+
+/** 
+ * Get a pointer to the block number of the block at position lblk in the given inode's file
+ * (the direct blocks, followed by the blocks in the indirect block, then those in the indirect
+ * blocks listed in the double indirect block), or NULL if it would be in an indirect block that
+ * doesn't exist yet.
+ */
+vsfs_blk_t *inode_block_number(fs_ctx *fs, vsfs_inode *inode, uint32_t lblk) {
+
+	if (lblk < VSFS_NUM_DIRECT) {
+		return &inode->i_direct[lblk];
+	}
+	uint32_t first;
+	vsfs_blk_t indirect = inode_indirect_block(fs, inode, lblk, &first);
+	if (indirect == VSFS_BLK_UNASSIGNED) {
+		return NULL;
+	}
+	vsfs_blk_t *indirect_block_number = (vsfs_blk_t *)fs_block(fs, indirect);
+	return &indirect_block_number[lblk - first];
+}
+
+/** 
+ * Like inode_map_block(), but only count up to max blocks into len, so that callers that only
+ * look at a few blocks of a large file don't pay for walking a long run of block pointers.
+ */
+static vsfs_blk_t inode_map_run(fs_ctx *fs, vsfs_inode *inode, uint32_t lblk, uint32_t max, uint32_t *len) {
+	if (inode_has_extents(fs, inode)) {
+		// Find the last extent that starts at or before lblk
+		vsfs_extent *extents = inode_extents(fs, inode);
+		uint32_t lo = 0;
+		uint32_t hi = inode->i_num_extents;
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (extents[mid].e_lblk <= lblk) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if (lo == 0 || lblk - extents[lo - 1].e_lblk >= extents[lo - 1].e_len) {
+			// The hole runs up to the next extent, if there is one
+			if (len != NULL) {
+				uint32_t end = (lo < inode->i_num_extents) ? extents[lo].e_lblk : inode->i_blocks;
+				*len = (end - lblk < max) ? end - lblk : max;
+			}
+			return VSFS_BLK_UNASSIGNED;
+		}
+		vsfs_extent *extent = &extents[lo - 1];
+		if (len != NULL) {
+			uint32_t left = extent->e_len - (lblk - extent->e_lblk);
+			*len = (left < max) ? left : max;
+		}
+		return extent->e_pblk + (lblk - extent->e_lblk);
+	}
+
+	// Blocks in indirect blocks that don't exist yet are holes too
+	vsfs_blk_t *block_number = inode_block_number(fs, inode, lblk);
+	vsfs_blk_t first = (block_number == NULL) ? VSFS_BLK_UNASSIGNED : *block_number;
+	if (len != NULL) {
+		*len = 1;
+		while (*len < max && lblk + *len < inode->i_blocks) {
+			vsfs_blk_t *next_block_number = inode_block_number(fs, inode, lblk + *len);
+			vsfs_blk_t next = (next_block_number == NULL) ? VSFS_BLK_UNASSIGNED : *next_block_number;
+			if (next != ((first == VSFS_BLK_UNASSIGNED) ? VSFS_BLK_UNASSIGNED : first + *len)) {
+				break;
+			}
+			*len += 1;
+		}
+	}
+	return first;
+}
+
+/** 
+ * Get the block number of the block at position lblk in the given inode's file, or
+ * VSFS_BLK_UNASSIGNED if it is in a hole. Unless len is NULL, it is set to the number of blocks of
+ * the file from lblk on that are contiguous on disk, so that they can be copied at once, or that
+ * are in the same hole.
+ */
+vsfs_blk_t inode_map_block(fs_ctx *fs, vsfs_inode *inode, uint32_t lblk, uint32_t *len) {
+	return inode_map_run(fs, inode, lblk, UINT32_MAX, len);
+}
+
+/** Find the block map cache of the given inode, or NULL if none of its open files has one. */
+static block_map_cache *find_map_cache(fs_ctx *fs, vsfs_ino_t ino) {
+	block_map_cache *map = fs->map_caches[ino % VSFS_MAP_CACHE_BUCKETS];
+	while (map != NULL && map->ino != ino) {
+		map = map->next;
+	}
+	return map;
+}
+
+/** 
+ * Get the block map cache of the given open file, creating it (or joining the one the inode's
+ * other open files use) if needed, and make sure that it has room for the block at position
+ * lblk. Returns NULL if out of memory; the caller then goes to the inode instead.
+ */
+static block_map_cache *file_map_cache(fs_ctx *fs, open_file *file, vsfs_inode *inode, uint32_t lblk) {
+	block_map_cache *map = file->map;
+	if (map == NULL) {
+		map = find_map_cache(fs, file->ino);
+		if (map == NULL) {
+			map = calloc(1, sizeof(block_map_cache));
+			if (map == NULL) {
+				return NULL;
+			}
+			map->ino = file->ino;
+			map->next = fs->map_caches[file->ino % VSFS_MAP_CACHE_BUCKETS];
+			fs->map_caches[file->ino % VSFS_MAP_CACHE_BUCKETS] = map;
+		}
+		map->refs += 1;
+		file->map = map;
+	}
+
+	// Make room for all of the file's current blocks at once
+	if (lblk >= map->size) {
+		uint32_t size = (inode->i_blocks > lblk) ? inode->i_blocks : lblk + 1;
+		vsfs_blk_t *blocks = realloc(map->blocks, (size_t)size * sizeof(vsfs_blk_t));
+		if (blocks == NULL) {
+			return NULL;
+		}
+		memset(blocks + map->size, 0, (size_t)(size - map->size) * sizeof(vsfs_blk_t));
+		map->blocks = blocks;
+		map->size = size;
+	}
+	return map;
+}
+
+/** 
+ * Fill in the block map cache entries of the blocks of the given inode's file around position
+ * lblk: the rest of the run of contiguous blocks with extents, or all of the block numbers in the
+ * direct blocks or in the indirect block that lblk is in with block pointers. Entries of holes
+ * stay 0.
+ */
+static void fill_map_cache(fs_ctx *fs, block_map_cache *map, vsfs_inode *inode, uint32_t lblk) {
+	uint32_t end = (inode->i_blocks < map->size) ? inode->i_blocks : map->size;
+
+	if (inode_has_extents(fs, inode)) {
+		uint32_t len;
+		vsfs_blk_t pblk = inode_map_block(fs, inode, lblk, &len);
+		if (pblk == VSFS_BLK_UNASSIGNED) {
+			return;
+		}
+		for (uint32_t n = 0; n < len && lblk + n < end; ++n) {
+			map->blocks[lblk + n] = pblk + n;
+		}
+		return;
+	}
+
+	uint32_t first = 0;
+	vsfs_blk_t *block_numbers = inode->i_direct;
+	uint32_t count = VSFS_NUM_DIRECT;
+	if (lblk >= VSFS_NUM_DIRECT) {
+		vsfs_blk_t indirect = inode_indirect_block(fs, inode, lblk, &first);
+		if (indirect == VSFS_BLK_UNASSIGNED) {
+			return;
+		}
+		block_numbers = (vsfs_blk_t *)fs_block(fs, indirect);
+		count = fs->num_blk_per_b;
+	}
+	// The indirect block may map only blocks past the end of the file or of the cache
+	if (first >= end) {
+		return;
+	}
+	if (first + count > end) {
+		count = end - first;
+	}
+	memcpy(map->blocks + first, block_numbers, (size_t)count * sizeof(vsfs_blk_t));
+}
+
+/** Give back the blocks reserved ahead of appends to the file with the given block map cache. */
+static void trim_prealloc(fs_ctx *fs, block_map_cache *map) {
+	bitmap_summary_unreserve(&fs->dbmap_summary, map->prealloc_start, map->prealloc_len);
+	map->prealloc_len = 0;
+}
+
+/** 
+ * Give back the blocks reserved ahead of appends to all of the open files, when they are needed
+ * elsewhere or the file system is unmounted.
+ */
+void trim_all_preallocs(fs_ctx *fs) {
+	for (uint32_t bucket = 0; bucket < VSFS_MAP_CACHE_BUCKETS; ++bucket) {
+		for (block_map_cache *map = fs->map_caches[bucket]; map != NULL; map = map->next) {
+			trim_prealloc(fs, map);
+		}
+	}
+}
+
+/** 
+ * Check if count data blocks are free for an allocation. The blocks reserved ahead of appends to
+ * open files are free on disk, but can't be allocated until they are given back, which they are
+ * if that's what it takes.
+ */
+static bool have_free_blocks(fs_ctx *fs, uint32_t count) {
+	if (fs->sb->sb_free_blocks - fs->dbmap_summary.nreserved < count) {
+		trim_all_preallocs(fs);
+	}
+	return fs->sb->sb_free_blocks - fs->dbmap_summary.nreserved >= count;
+}
+
+/** 
+ * Clear the block map cache entries of the blocks from position lblk on of the file with the
+ * given inode number, which are about to be freed. The blocks reserved ahead of appends to the
+ * file are given back too, as the file no longer ends where they start.
+ */
+static void invalidate_map_cache(fs_ctx *fs, vsfs_ino_t ino, uint32_t lblk) {
+	block_map_cache *map = find_map_cache(fs, ino);
+	if (map != NULL && lblk < map->size) {
+		memset(map->blocks + lblk, 0, (size_t)(map->size - lblk) * sizeof(vsfs_blk_t));
+	}
+	if (map != NULL) {
+		trim_prealloc(fs, map);
+	}
+}
+
+/** 
+ * Like inode_map_block(), but through the block map cache of the open file, so that only blocks
+ * that haven't been looked up before (or are in holes) go through the inode and the indirect or
+ * extent blocks.
+ */
+static vsfs_blk_t file_map_block(fs_ctx *fs, open_file *file, vsfs_inode *inode, uint32_t lblk) {
+	block_map_cache *map = file_map_cache(fs, file, inode, lblk);
+	if (map == NULL) {
+		return inode_map_block(fs, inode, lblk, NULL);
+	}
+	if (map->blocks[lblk] == 0) {
+		fill_map_cache(fs, map, inode, lblk);
+	}
+	return map->blocks[lblk];
+}
+
+/** 
+ * Allocate a data block, searching from the goal block onwards, and fill it with zeros. The caller
+ * must check that a block is free (see have_free_blocks()).
+ */
+vsfs_blk_t allocate_zeroed_block(fs_ctx *fs, vsfs_blk_t goal) {
+	vsfs_superblock *superblock = fs->sb;
+
+	uint32_t next_data_bitmap_index;
+	allocate_bitmap_index(&fs->dbmap_summary, &goal, &next_data_bitmap_index);
+	superblock->sb_free_blocks -= 1;
+	memset(fs_block(fs, next_data_bitmap_index), 0, VSFS_BLOCK_SIZE);
+	return next_data_bitmap_index;
+}
+
+/** Get the first data block of a block group (past its slice of the inode table). */
+static vsfs_blk_t group_first_data_block(fs_ctx *fs, uint32_t group) {
+	if (group == 0) {
+		return fs->sb->sb_data_region;
+	}
+	return group * fs->blocks_per_group + fs->inodes_per_group / fs->inodes_per_block;
+}
+
+/** Count the free data blocks of a block group. */
+static uint32_t group_free_blocks(fs_ctx *fs, uint32_t group) {
+	vsfs_blk_t first = group * fs->blocks_per_group;
+	return bitmap_summary_count_free(&fs->dbmap_summary, first, first + fs->blocks_per_group);
+}
+
+/** 
+ * Get the block from which to search for the first data block of the file with the given inode:
+ * the start of the data blocks of its inode's block group, or without block groups, wherever the
+ * last data block allocation left off.
+ */
+static vsfs_blk_t inode_goal_block(fs_ctx *fs, vsfs_ino_t ino) {
+	if (fs->num_groups == 0) {
+		return fs->dbmap_cursor;
+	}
+	return group_first_data_block(fs, ino / fs->inodes_per_group);
+}
+
+/** 
+ * Get the block from which to search for a block holding part of the block map of the file with
+ * the given inode: the start of its block group, or of the data region. Keeping these apart from
+ * the data leaves the file's runs of data blocks unbroken.
+ */
+static vsfs_blk_t map_goal_block(fs_ctx *fs, vsfs_ino_t ino) {
+	if (fs->num_groups == 0) {
+		return fs->sb->sb_data_region;
+	}
+	return group_first_data_block(fs, ino / fs->inodes_per_group);
+}
+
+/** Check if the given block is a free data block. */
+static bool block_is_free(fs_ctx *fs, vsfs_blk_t block) {
+	return block < fs->sb->sb_num_blocks && bitmap_summary_isfree(&fs->dbmap_summary, block);
+}
+
+/** 
+ * Get the block from which to search for a new data block at position lblk of the file with the
+ * given inode: the block after the file's block at lblk - 1, so that the file is extended
+ * contiguously, or when filling a hole from its end, the block before the file's block at
+ * lblk + 1. If other files have taken those blocks, searching on from there would only make the
+ * files' blocks alternate, so the search starts in the middle of the largest free run instead (in
+ * the inode's block group, if possible). That leaves room to grow for both this file and whatever
+ * ends up before it in the run.
+ */
+static vsfs_blk_t file_goal_block(fs_ctx *fs, vsfs_ino_t ino, vsfs_inode *inode, uint32_t lblk) {
+	vsfs_blk_t prev = (lblk > 0) ? inode_map_block(fs, inode, lblk - 1, NULL) : VSFS_BLK_UNASSIGNED;
+	if (prev != VSFS_BLK_UNASSIGNED && block_is_free(fs, prev + 1)) {
+		return prev + 1;
+	}
+	vsfs_blk_t next = (lblk + 1 < inode->i_blocks) ? inode_map_block(fs, inode, lblk + 1, NULL) : VSFS_BLK_UNASSIGNED;
+	if (next != VSFS_BLK_UNASSIGNED && block_is_free(fs, next - 1)) {
+		return next - 1;
+	}
+	if (lblk == 0 && next == VSFS_BLK_UNASSIGNED) {
+		return inode_goal_block(fs, ino);
+	}
+
+	uint32_t start, len;
+	bool found = false;
+	if (fs->num_groups != 0) {
+		vsfs_blk_t first = (ino / fs->inodes_per_group) * fs->blocks_per_group;
+		found = bitmap_summary_find_largest(&fs->dbmap_summary, first, first + fs->blocks_per_group, &start, &len);
+	}
+	if (!found) {
+		found = bitmap_summary_find_largest(&fs->dbmap_summary, 0, fs->sb->sb_num_blocks, &start, &len);
+	}
+	return found ? start + len / 2 : inode_goal_block(fs, ino);
+}
+
+/** 
+ * Get the inode from which to search for a free inode for a new file. With block groups, this
+ * stays in the group of the last inode allocated, unless fewer of its data blocks are free than
+ * the average over all groups; then it moves on to the start of the next group that has at least
+ * that many, so that the new file's data can be allocated in its home group.
+ */
+static uint32_t inode_search_start(fs_ctx *fs) {
+	if (fs->num_groups == 0) {
+		return fs->ibmap_cursor;
+	}
+	uint32_t group = (fs->ibmap_cursor / fs->inodes_per_group) % fs->num_groups;
+	uint32_t average = fs->sb->sb_free_blocks / fs->num_groups;
+	for (uint32_t n = 0; n < fs->num_groups; ++n) {
+		uint32_t next_group = (group + n) % fs->num_groups;
+		if (group_free_blocks(fs, next_group) >= average) {
+			return (n == 0) ? fs->ibmap_cursor : next_group * fs->inodes_per_group;
+		}
+	}
+	return fs->ibmap_cursor;
+}
+
+/** Return a data block to the free pool. */
+void free_data_block(fs_ctx *fs, vsfs_blk_t block_number) {
+	vsfs_superblock *superblock = fs->sb;
+
+	bitmap_summary_free(&fs->dbmap_summary, block_number);
+	superblock->sb_free_blocks += 1;
+}
+
+/** 
+ * Count the indirect blocks (and the double indirect block) that a file mapped with block pointers
+ * still has to allocate before it can map the blocks from position first up to end.
+ */
+static uint32_t missing_map_blocks(fs_ctx *fs, vsfs_inode *inode, uint32_t first, uint32_t end) {
+	uint32_t double_first = double_indirect_first(fs);
+	uint32_t count = 0;
+
+	if (first < double_first && end > VSFS_NUM_DIRECT && inode->i_indirect == VSFS_BLK_UNASSIGNED) {
+		count += 1;
+	}
+	if (end > double_first) {
+		uint32_t from = ((first > double_first) ? first - double_first : 0) / fs->num_blk_per_b;
+		uint32_t to = (end - 1 - double_first) / fs->num_blk_per_b;
+		if (inode->i_double_indirect == VSFS_BLK_UNASSIGNED) {
+			return count + 1 + (to - from + 1);
+		}
+		vsfs_blk_t *indirect_blocks = (vsfs_blk_t *)fs_block(fs, inode->i_double_indirect);
+		for (uint32_t i = from; i <= to; ++i) {
+			count += (indirect_blocks[i] == VSFS_BLK_UNASSIGNED);
+		}
+	}
+	return count;
+}
+
+/** 
+ * Allocate the indirect block (and the double indirect block) that a file mapped with block
+ * pointers needs to map the block at position lblk, if it doesn't have them yet, searching from
+ * the goal block. The caller must check that there are enough free blocks. Returns the block
+ * after the last one allocated, or the goal block if none were needed.
+ */
+static vsfs_blk_t allocate_map_blocks(fs_ctx *fs, vsfs_inode *inode, uint32_t lblk, vsfs_blk_t goal) {
+	// A zeroed indirect block has all of its pointers unassigned
+	if (lblk < VSFS_NUM_DIRECT) {
+		return goal;
+	}
+	if (lblk < double_indirect_first(fs)) {
+		if (inode->i_indirect == VSFS_BLK_UNASSIGNED) {
+			inode->i_indirect = allocate_zeroed_block(fs, goal);
+			goal = inode->i_indirect + 1;
+		}
+		return goal;
+	}
+
+	if (inode->i_double_indirect == VSFS_BLK_UNASSIGNED) {
+		inode->i_double_indirect = allocate_zeroed_block(fs, goal);
+		goal = inode->i_double_indirect + 1;
+	}
+	vsfs_blk_t *indirect_blocks = (vsfs_blk_t *)fs_block(fs, inode->i_double_indirect);
+	uint32_t index = (lblk - double_indirect_first(fs)) / fs->num_blk_per_b;
+	if (indirect_blocks[index] == VSFS_BLK_UNASSIGNED) {
+		indirect_blocks[index] = allocate_zeroed_block(fs, goal);
+		goal = indirect_blocks[index] + 1;
+	}
+	return goal;
+}
+
+/** 
+ * Free the data blocks of a file mapped with block pointers from position new_blocks up to
+ * old_blocks, skipping its holes, and then the indirect blocks (and the double indirect block)
+ * that it no longer needs.
+ */
+static void free_pointer_blocks(fs_ctx *fs, vsfs_inode *inode, uint32_t old_blocks, uint32_t new_blocks) {
+	for (uint32_t lblk = new_blocks; lblk < old_blocks; ) {
+		vsfs_blk_t *block_number = inode_block_number(fs, inode, lblk);
+		if (block_number == NULL) {
+			// Skip the blocks the missing indirect block would have mapped
+			uint32_t first;
+			inode_indirect_block(fs, inode, lblk, &first);
+			lblk = first + fs->num_blk_per_b;
+			continue;
+		}
+		if (*block_number != VSFS_BLK_UNASSIGNED) {
+			free_data_block(fs, *block_number);
+			*block_number = VSFS_BLK_UNASSIGNED;
+		}
+		lblk += 1;
+	}
+
+	uint32_t double_first = double_indirect_first(fs);
+	if (old_blocks > double_first && inode->i_double_indirect != VSFS_BLK_UNASSIGNED) {
+		vsfs_blk_t *indirect_blocks = (vsfs_blk_t *)fs_block(fs, inode->i_double_indirect);
+		for (uint32_t i = double_indirect_count(fs, new_blocks); i < double_indirect_count(fs, old_blocks); ++i) {
+			if (indirect_blocks[i] != VSFS_BLK_UNASSIGNED) {
+				free_data_block(fs, indirect_blocks[i]);
+				indirect_blocks[i] = VSFS_BLK_UNASSIGNED;
+			}
+		}
+		if (new_blocks <= double_first) {
+			free_data_block(fs, inode->i_double_indirect);
+			inode->i_double_indirect = VSFS_BLK_UNASSIGNED;
+		}
+	}
+	if (new_blocks <= VSFS_NUM_DIRECT && inode->i_indirect != VSFS_BLK_UNASSIGNED) {
+		free_data_block(fs, inode->i_indirect);
+		inode->i_indirect = VSFS_BLK_UNASSIGNED;
+	}
+}
+
+/** 
+ * Set the number of extents of the given inode's file, which were found at extents (see
+ * inode_extents()) before their number changed. The extents are moved back into the inode
+ * (freeing the extent block) once they fit.
+ */
+static void set_extent_count(fs_ctx *fs, vsfs_inode *inode, vsfs_extent *extents, uint32_t count) {
+	inode->i_num_extents = count;
+	if (count <= VSFS_INLINE_EXTENTS && extents != inode->i_extents) {
+		vsfs_blk_t extent_block = inode->i_extent_block;
+		memset(inode->i_extents, 0, sizeof(inode->i_extents));
+		memcpy(inode->i_extents, extents, count * sizeof(vsfs_extent));
+		free_data_block(fs, extent_block);
+	}
+}
+
+/** 
+ * Add the run of len blocks from block pblk on as the blocks at lblk onwards of the file with the
+ * given inode, which must be a hole. The run is merged into the extents before and after it where
+ * it continues them on disk. Moving the extents out of the inode takes an extent block. Returns 0
+ * on success, -ENOSPC if there is no free block for the extent block, or -EFBIG if the extent
+ * block is full.
+ */
+static int add_extent(fs_ctx *fs, vsfs_ino_t ino, vsfs_inode *inode, uint32_t lblk, vsfs_blk_t pblk, uint32_t len) {
+	vsfs_extent *extents = inode_extents(fs, inode);
+	uint32_t count = inode->i_num_extents;
+
+	// Find where the run goes: after all the extents that start before it
+	uint32_t pos = count;
+	while (pos > 0 && extents[pos - 1].e_lblk > lblk) {
+		pos -= 1;
+	}
+	vsfs_extent *prev = (pos > 0) ? &extents[pos - 1] : NULL;
+	vsfs_extent *next = (pos < count) ? &extents[pos] : NULL;
+	assert(prev == NULL || prev->e_lblk + prev->e_len <= lblk);
+	assert(next == NULL || lblk + len <= next->e_lblk);
+
+	bool joins_prev = prev != NULL && prev->e_lblk + prev->e_len == lblk && prev->e_pblk + prev->e_len == pblk;
+	bool joins_next = next != NULL && lblk + len == next->e_lblk && pblk + len == next->e_pblk;
+	if (joins_prev && joins_next) {
+		prev->e_len += len + next->e_len;
+		memmove(next, next + 1, (count - pos - 1) * sizeof(vsfs_extent));
+		set_extent_count(fs, inode, extents, count - 1);
+		return 0;
+	}
+	if (joins_prev) {
+		prev->e_len += len;
+		return 0;
+	}
+	if (joins_next) {
+		next->e_lblk = lblk;
+		next->e_pblk = pblk;
+		next->e_len += len;
+		return 0;
+	}
+
+	if (count == VSFS_BLOCK_EXTENTS) {
+		return -EFBIG;
+	}
+	if (count == VSFS_INLINE_EXTENTS) {
+		if (!have_free_blocks(fs, 1)) {
+			return -ENOSPC;
+		}
+		vsfs_blk_t extent_block = allocate_zeroed_block(fs, map_goal_block(fs, ino));
+		extents = (vsfs_extent *)fs_block(fs, extent_block);
+		memcpy(extents, inode->i_extents, sizeof(inode->i_extents));
+		memset(inode->i_extents, 0, sizeof(inode->i_extents));
+		inode->i_extent_block = extent_block;
+	}
+
+	memmove(&extents[pos + 1], &extents[pos], (count - pos) * sizeof(vsfs_extent));
+	extents[pos].e_lblk = lblk;
+	extents[pos].e_pblk = pblk;
+	extents[pos].e_len = len;
+	inode->i_num_extents = count + 1;
+	return 0;
+}
+
+/** 
+ * Free the blocks of the file with the given inode from position lblk on, and drop or shorten
+ * the extents that mapped them (see set_extent_count()).
+ */
+static void truncate_extents(fs_ctx *fs, vsfs_inode *inode, uint32_t lblk) {
+	vsfs_extent *extents = inode_extents(fs, inode);
+
+	while (inode->i_num_extents > 0) {
+		vsfs_extent *last = &extents[inode->i_num_extents - 1];
+		if (last->e_lblk + last->e_len <= lblk) {
+			break;
+		}
+		uint32_t keep = (last->e_lblk < lblk) ? lblk - last->e_lblk : 0;
+		for (uint32_t i = keep; i < last->e_len; ++i) {
+			free_data_block(fs, last->e_pblk + i);
+		}
+		last->e_len = keep;
+		if (keep != 0) {
+			break;
+		}
+		inode->i_num_extents -= 1;
+	}
+	set_extent_count(fs, inode, extents, inode->i_num_extents);
+}
+
+/** 
+ * Check if the blocks reserved ahead of appends to the file with the given inode and block map
+ * cache follow its block at position lblk - 1 on disk, so that the file can go on into them.
+ */
+static bool prealloc_continues(fs_ctx *fs, block_map_cache *map, vsfs_inode *inode, uint32_t lblk) {
+	if (map->prealloc_len == 0 || lblk == 0) {
+		return false;
+	}
+	vsfs_blk_t prev = inode_map_block(fs, inode, lblk - 1, NULL);
+	return prev != VSFS_BLK_UNASSIGNED && prev + 1 == map->prealloc_start;
+}
+
+/** 
+ * Allocate a run of up to len data blocks, searching from the goal block, and return the first
+ * one and their number in start and got. Unless map is NULL, the run is appended to the end of
+ * its file, and the next blocks to append are reserved right behind it in the same search: a
+ * batch that doubles each time (from VSFS_PREALLOC_MIN up to VSFS_PREALLOC_MAX), so that a file
+ * that keeps growing needs fewer and fewer searches. One free block is left over for an extent
+ * block that the run may need.
+ */
+static void allocate_data_run(fs_ctx *fs, block_map_cache *map, vsfs_blk_t goal, uint32_t len, uint32_t *start, uint32_t *got) {
+	uint32_t ahead = 0;
+	if (map != NULL) {
+		ahead = (map->prealloc_next != 0) ? map->prealloc_next : VSFS_PREALLOC_MIN;
+		uint32_t avail = fs->sb->sb_free_blocks - fs->dbmap_summary.nreserved;
+		uint32_t spare = (avail > len + 1) ? avail - len - 1 : 0;
+		if (ahead > spare) {
+			ahead = spare;
+		}
+		// Only as many as are free right behind a run that continues the file are taken, so
+		// that the run isn't moved elsewhere for their sake
+		uint32_t free_run = 0;
+		while (free_run < len + ahead && block_is_free(fs, goal + free_run)) {
+			free_run += 1;
+		}
+		if (free_run >= len && free_run < len + ahead) {
+			ahead = free_run - len;
+		}
+	}
+
+	// The whole run is reserved, and only the blocks that are used right away are claimed
+	uint32_t total;
+	int err = bitmap_summary_reserve_range(&fs->dbmap_summary, goal, len + ahead, start, &total);
+	assert(!err);
+	*got = (total < len) ? total : len;
+	bitmap_summary_claim(&fs->dbmap_summary, *start, *got);
+	fs->sb->sb_free_blocks -= *got;
+	fs->dbmap_cursor = *start + total;
+
+	if (total > *got) {
+		map->prealloc_start = *start + *got;
+		map->prealloc_len = total - *got;
+		map->prealloc_next = (ahead < VSFS_PREALLOC_MAX / 2) ? ahead * 2 : VSFS_PREALLOC_MAX;
+	}
+}
+
+/** 
+ * Allocate data blocks for the holes among the blocks of the file with the given inode that hold
+ * the size bytes from offset on, in as few contiguous runs as possible, along with the indirect
+ * blocks or the extent block needed to map them. Each run continues the file's blocks on either
+ * side of it on disk where possible; appends to an open file go on into the blocks allocated ahead
+ * of them (see allocate_data_run()). Only the parts of the new blocks outside of the range are
+ * zeroed, as the caller is about to write the rest. On return, filled is the position of the
+ * first block from which on the blocks may still be holes. Returns 0 on success, or -ENOSPC if
+ * there are not enough free blocks or -EFBIG if the file's extents don't fit into an extent
+ * block, in which case only the blocks before filled were allocated.
+ */
+static int fill_holes(fs_ctx *fs, vsfs_ino_t ino, vsfs_inode *inode, uint64_t offset, uint64_t size, uint32_t *filled) {
+	bool extents = inode_has_extents(fs, inode);
+	uint32_t first = offset / VSFS_BLOCK_SIZE;
+	uint32_t end = (offset + size + VSFS_BLOCK_SIZE - 1) / VSFS_BLOCK_SIZE;
+
+	// An extent block is only needed if a run turns out not to join an extent, so running out
+	// of space for it is handled along the way
+	uint32_t blocks_needed = 0;
+	for (uint32_t lblk = first, len; lblk < end; lblk += len) {
+		if (inode_map_run(fs, inode, lblk, end - lblk, &len) == VSFS_BLK_UNASSIGNED) {
+			blocks_needed += len;
+		}
+	}
+	if (blocks_needed != 0 && !extents) {
+		blocks_needed += missing_map_blocks(fs, inode, first, end);
+	}
+	*filled = first;
+	if (!have_free_blocks(fs, blocks_needed)) {
+		return -ENOSPC;
+	}
+
+	block_map_cache *map = find_map_cache(fs, ino);
+	for (uint32_t lblk = first, len; lblk < end; lblk += len, *filled = lblk) {
+		if (inode_map_run(fs, inode, lblk, end - lblk, &len) != VSFS_BLK_UNASSIGNED) {
+			continue;
+		}
+		// Only a run that ends the file of an open file is an append. It doesn't go on into the
+		// blocks reserved ahead of it if it needs a new indirect block, which goes first instead
+		block_map_cache *append_map = (map != NULL && lblk + len == inode->i_blocks) ? map : NULL;
+		bool continues = append_map != NULL && prealloc_continues(fs, append_map, inode, lblk) &&
+		                 (extents || missing_map_blocks(fs, inode, lblk, lblk + len) == 0);
+		if (append_map != NULL && !continues) {
+			trim_prealloc(fs, append_map);
+		}
+		// An extent block allocated along the way may have taken the last free block
+		if (!continues && !have_free_blocks(fs, 1)) {
+			return -ENOSPC;
+		}
+
+		uint32_t start, got;
+		if (continues) {
+			start = map->prealloc_start;
+			got = (len < map->prealloc_len) ? len : map->prealloc_len;
+			map->prealloc_start += got;
+			map->prealloc_len -= got;
+			bitmap_summary_claim(&fs->dbmap_summary, start, got);
+			fs->sb->sb_free_blocks -= got;
+		}
+		else {
+			// Allocate the indirect blocks before the data blocks, so that they don't split up a run
+			vsfs_blk_t goal = file_goal_block(fs, ino, inode, lblk);
+			for (uint32_t l = lblk; !extents && l < lblk + len; l = next_map_boundary(fs, l)) {
+				goal = allocate_map_blocks(fs, inode, l, goal);
+			}
+			allocate_data_run(fs, append_map, goal, len, &start, &got);
+		}
+		len = got;
+
+		uint64_t run_start = (uint64_t)lblk * VSFS_BLOCK_SIZE;
+		uint64_t run_end = run_start + (uint64_t)len * VSFS_BLOCK_SIZE;
+		if (offset > run_start) {
+			memset(fs_block(fs, start), 0, offset - run_start);
+		}
+		if (offset + size < run_end) {
+			memset(fs_block(fs, start) + (offset + size - run_start), 0, run_end - (offset + size));
+		}
+
+		if (extents) {
+			int err = add_extent(fs, ino, inode, lblk, start, len);
+			if (err != 0) {
+				for (uint32_t i = 0; i < len; ++i) {
+					free_data_block(fs, start + i);
 				}
+				return err;
+			}
+		}
+		else {
+			for (uint32_t i = 0; i < len; ++i) {
+				*inode_block_number(fs, inode, lblk + i) = start + i;
 			}
-			valid_blocks_found += 1;
 		}
-		array_index += 1;
 	}
-	*directory_array_index_output = VSFS_BLK_UNASSIGNED;
-	*index_within_array = VSFS_INO_MAX;
-	return valid_blocks_found;
+	*filled = end;
+	return 0;
 }
 
 /** 
- * Check if the input bitmap has any available space, and if so, set found_index to the next available
- * block index from the input bitmap.
+ * Set the size of the file with the given inode. Growing it only moves the end of file: the new
+ * blocks are a hole, which reads back as zeros and gets its blocks when they are first written
+ * (see fill_holes()). Shrinking it frees the blocks past the new end of file (and the indirect or
+ * extent block, once unused). Returns 0 on success, or -EFBIG if the size is beyond the maximum
+ * file size, in which case nothing is changed.
  */
-void allocate_bitmap_index(bitmap_t *bitmap, uint32_t size, uint32_t *found_index) {
-    int err = bitmap_alloc(bitmap, size, found_index);
-    assert(!err);
+static int resize_blocks(fs_ctx *fs, vsfs_ino_t ino, off_t size) {
+	vsfs_inode *inode = fs_inode(fs, ino);
+
+	if ((uint64_t)size > (uint64_t)fs->max_file_blocks * VSFS_BLOCK_SIZE) {
+		return -EFBIG;
+	}
+	uint32_t old_blocks = inode->i_blocks;
+	// Sizes past 4 GiB don't fit into div_round_up()'s arguments
+	uint32_t new_blocks = ((uint64_t)size + VSFS_BLOCK_SIZE - 1) / VSFS_BLOCK_SIZE;
+
+	// A shrink leaves stale data past the end of file in the last block, which must read back
+	// as zeros once the file grows over it again
+	uint32_t tail = inode->i_size % VSFS_BLOCK_SIZE;
+	if ((uint64_t)size > inode->i_size && tail != 0) {
+		vsfs_blk_t last_block = inode_map_block(fs, inode, inode->i_size / VSFS_BLOCK_SIZE, NULL);
+		if (last_block != VSFS_BLK_UNASSIGNED) {
+			memset(fs_block(fs, last_block) + tail, 0, VSFS_BLOCK_SIZE - tail);
+		}
+	}
+
+	// The double indirect block is only meaningful once the file reaches it
+	if (!inode_has_extents(fs, inode) && old_blocks <= double_indirect_first(fs) &&
+	    new_blocks > double_indirect_first(fs)) {
+		inode->i_double_indirect = VSFS_BLK_UNASSIGNED;
+	}
+
+	if (new_blocks < old_blocks) {
+		invalidate_map_cache(fs, ino, new_blocks);
+		if (inode_has_extents(fs, inode)) {
+			truncate_extents(fs, inode, new_blocks);
+		}
+		else {
+			free_pointer_blocks(fs, inode, old_blocks, new_blocks);
+		}
+	}
+
+	inode->i_blocks = new_blocks;
+	inode->i_size = size;
+	if (clock_gettime(CLOCK_REALTIME, &(inode->i_mtime)) != 0) {
+		perror("clock_gettime");
+		return -ENOSYS;
+	}
+	return 0;
 }
 
 /** 
- * Determine if there is any space in the input directory entry array, and if so, set block_index to
- * the next available block index from the directory entry array.
+ * Set the size of the file with the given inode, as for resize_blocks(). On an image with inline
+ * data, a regular file without blocks keeps its data in the inode for as long as it fits, and
+ * moves it to a data block once it grows past that. Returns 0 on success, or -errno as for
+ * resize_blocks() and fill_holes(), in which case nothing is changed.
  */
-int find_available_entry(uint32_t num_blocks, vsfs_blk_t *dentry_array, uint32_t *block_index) {
-    uint32_t available_block_index = VSFS_BLK_UNASSIGNED;
-    uint32_t index = 0;
-    while (index < num_blocks) {
-        if (dentry_array[index] == VSFS_BLK_UNASSIGNED) {
-            available_block_index = index;
-            break;
-        }
-        index += 1;
-    }
-	*block_index = available_block_index;
-	if (available_block_index == VSFS_BLK_UNASSIGNED && index == num_blocks) {
-		return -1;
+int truncate_inode(fs_ctx *fs, vsfs_ino_t ino, off_t size) {
+	vsfs_inode *inode = fs_inode(fs, ino);
+	if (fs->inline_max == 0 || !S_ISREG(inode->i_mode) || inode->i_blocks != 0) {
+		return resize_blocks(fs, ino, size);
+	}
+
+	// Bytes past the end of file are left over from an earlier size, or from the block map
+	char *data = inode_inline_data(inode);
+	if ((uint64_t)size <= fs->inline_max) {
+		if ((uint64_t)size > inode->i_size) {
+			memset(data + inode->i_size, 0, size - inode->i_size);
+		}
+		inode->i_size = size;
+		if (clock_gettime(CLOCK_REALTIME, &(inode->i_mtime)) != 0) {
+			perror("clock_gettime");
+			return -ENOSYS;
+		}
+		return 0;
+	}
+
+	// The space the data took is the block map again, so it must start out unassigned
+	char saved[VSFS_INODE_SIZE_MAX];
+	uint64_t inline_size = inode->i_size;
+	memcpy(saved, data, inline_size);
+	memset(data, 0, fs->inline_max);
+	inode->i_size = 0;
+
+	// Only the block holding the data is allocated; the rest of the file is a hole
+	uint32_t filled;
+	int err = resize_blocks(fs, ino, size);
+	if (err == 0 && inline_size != 0) {
+		err = fill_holes(fs, ino, inode, 0, inline_size, &filled);
+		if (err != 0) {
+			int ret = resize_blocks(fs, ino, 0);
+			assert(!ret);
+		}
+	}
+	if (err != 0) {
+		memcpy(data, saved, inline_size);
+		inode->i_size = inline_size;
+		return err;
+	}
+	if (inline_size != 0) {
+		memcpy(fs_block(fs, inode_map_block(fs, inode, 0, NULL)), saved, inline_size);
 	}
 	return 0;
 }
 
-/** Add the input directory entry to the input directory entry array. */
-int add_entry_to_block(vsfs_dentry *add_to_array, uint32_t dentry_array_index, vsfs_inode *new_file_inode, uint32_t inode_index, const char *path_name) {
-	fs_ctx *fs = get_fs();
-	vsfs_inode *itable = fs->itable;
-	vsfs_inode *root_inode = &itable[VSFS_ROOT_INO];
-
-    vsfs_dentry *new_file_dentry = &add_to_array[dentry_array_index];
-    new_file_dentry->ino = inode_index;
-    strcpy(new_file_dentry->name, path_name);
-	root_inode->i_mtime = new_file_inode->i_mtime;
-    return 0;
+/** 
+ * Get a pointer to the block number of the root directory block at position lblk in the
+ * root directory, or NULL if it would be in an indirect block that doesn't exist yet.
+ */
+vsfs_blk_t *root_dentry_block_number(fs_ctx *fs, uint32_t lblk) {
+	return inode_block_number(fs, fs_inode(fs, VSFS_ROOT_INO), lblk);
 }
 
 /** 
- * Allocate a new direct/indirect block and initialize the directory entry in the first 
- * position in the newly allocated data block with the input file.
+ * Get the root directory block at position lblk in the root directory, allocating it (and the
+ * indirect blocks that map it) if it doesn't exist yet. Returns NULL if there is not enough space.
  */
-int allocate_block(uint32_t num_blocks, vsfs_blk_t *dentry_array, vsfs_inode *new_file_inode, uint32_t inode_index, const char *path_name) {
-	fs_ctx *fs = get_fs();
+vsfs_dentry *get_or_allocate_dentry_block(fs_ctx *fs, uint32_t lblk) {
 	vsfs_superblock *superblock = fs->sb;
-	vsfs_inode *itable = fs->itable;
-	vsfs_inode *root_inode = &itable[VSFS_ROOT_INO];
-	bitmap_t *data_bitmap = fs->dbmap;
+	vsfs_inode *root_inode = fs_inode(fs, VSFS_ROOT_INO);
+	bitmap_summary *data_bitmap = &fs->dbmap_summary;
+
+	vsfs_blk_t *block_number = root_dentry_block_number(fs, lblk);
+	if (block_number != NULL && *block_number != VSFS_BLK_UNASSIGNED) {
+		return (vsfs_dentry *)fs_block(fs, *block_number);
+	}
+
+	uint32_t blocks_needed = 1 + missing_map_blocks(fs, root_inode, lblk, lblk + 1);
+	if (!have_free_blocks(fs, blocks_needed)) {
+		return NULL;
+	}
+
+	// Keep the directory's blocks together by searching from the one before the new block
+	uint32_t goal = fs->dbmap_cursor;
+	vsfs_blk_t *prev_block_number = (lblk == 0) ? NULL : root_dentry_block_number(fs, lblk - 1);
+	if (prev_block_number != NULL && *prev_block_number != VSFS_BLK_UNASSIGNED) {
+		goal = *prev_block_number + 1;
+	}
+
+	if (block_number == NULL) {
+		goal = allocate_map_blocks(fs, root_inode, lblk, goal);
+		block_number = root_dentry_block_number(fs, lblk);
+	}
 
 	uint32_t next_data_bitmap_index;
-	allocate_bitmap_index(data_bitmap, superblock->sb_num_blocks, &next_data_bitmap_index);
+	allocate_bitmap_index(data_bitmap, &goal, &next_data_bitmap_index);
 	superblock->sb_free_blocks -= 1;
 
-	uint32_t next_avail_index = VSFS_BLK_UNASSIGNED;
-	int err = find_available_entry(num_blocks, dentry_array, &next_avail_index);
+	*block_number = next_data_bitmap_index;
+	vsfs_dentry *new_block = (vsfs_dentry *)fs_block(fs, *block_number);
+	if (fs->var_len_dir) {
+		dentry_var_init_block(new_block);
+	}
+	else {
+		memset(new_block, 0, VSFS_BLOCK_SIZE);
+		for (uint32_t i = 0; i < fs->num_d_db; ++i) {
+			new_block[i].ino = VSFS_INO_MAX;
+		}
+	}
+	root_inode->i_blocks += 1;
+	root_inode->i_size += VSFS_BLOCK_SIZE;
+	return new_block;
+}
+
+/** 
+ * Find the directory entry with the given name in a hashed root directory by reading the chain
+ * of directory blocks of the name's home bucket (see VSFS_HASHED_DIR_BUCKETS). Returns true and
+ * sets path_entry to the location of the entry if the name exists.
+ */
+bool hashed_dir_lookup(fs_ctx *fs, const char *path_name, dir_index_entry *path_entry) {
+	uint32_t hash = dir_name_hash(path_name);
 
-	if (err != -1) {
-		dentry_array[next_avail_index] = next_data_bitmap_index;
-		vsfs_dentry *add_to_array = (vsfs_dentry *)(fs->image + dentry_array[next_avail_index] * VSFS_BLOCK_SIZE);
-		add_entry_to_block(add_to_array, 0, new_file_inode, inode_index, path_name);
-		root_inode->i_blocks += 1;
-		root_inode->i_size += VSFS_BLOCK_SIZE;
-		for (uint32_t i = 1; i < fs->num_d_db; ++i) {
-			add_to_array[i].ino = VSFS_INO_MAX;
+	for (uint32_t lblk = hash % VSFS_HASHED_DIR_BUCKETS; lblk < fs->root_max_blocks;
+	     lblk += VSFS_HASHED_DIR_BUCKETS) {
+		// A chain has no gaps, so it ends at its first missing block
+		vsfs_blk_t *block_number = root_dentry_block_number(fs, lblk);
+		if (block_number == NULL || *block_number == VSFS_BLK_UNASSIGNED) {
+			return false;
+		}
+
+		vsfs_dentry *block_head = (vsfs_dentry *)fs_block(fs, *block_number);
+		for (uint32_t slot = 0; slot < fs->num_d_db; ++slot) {
+			if (block_head[slot].ino != VSFS_INO_MAX && strcmp(block_head[slot].name, path_name) == 0) {
+				path_entry->hash = hash;
+				path_entry->ino = block_head[slot].ino;
+				path_entry->blk = *block_number;
+				path_entry->lblk = lblk;
+				path_entry->slot = slot;
+				return true;
+			}
 		}
-		return 0;
 	}
-	return -1;
+	return false;
 }
 
 /** 
- * Allocate the first indirect block needed by the file system and initialize the directory
- * entry in the first position in the newly allocated data block with the input file.
+ * Find the directory entry with the given name in the root directory, using the name index
+ * or, for a hashed root directory, the directory blocks themselves. Returns true and sets
+ * path_entry to the location of the entry if the name exists.
  */
-int allocate_first_indirect_block(vsfs_inode *new_file_inode, uint32_t inode_index, const char *path_name) {
-    fs_ctx *fs = get_fs();
-	vsfs_superblock *superblock = fs->sb;
-	vsfs_inode *itable = fs->itable;
-	vsfs_inode *root_inode = &itable[VSFS_ROOT_INO];
-	bitmap_t *data_bitmap = fs->dbmap;
+bool root_dir_lookup(fs_ctx *fs, const char *path_name, dir_index_entry *path_entry) {
 
-	uint32_t next_data_bitmap_index;
-	allocate_bitmap_index(data_bitmap, superblock->sb_num_blocks, &next_data_bitmap_index);
-	superblock->sb_free_blocks -= 1;
+	if (fs->hashed_dir) {
+		return hashed_dir_lookup(fs, path_name, path_entry);
+	}
+
+	dir_index_entry *index_entry = dir_index_find(&fs->root_index, path_name);
+	if (index_entry == NULL) {
+		return false;
+	}
+	*path_entry = *index_entry;
+	return true;
+}
 
-	root_inode->i_indirect = next_data_bitmap_index;
-	vsfs_blk_t *indirect_block_number = (vsfs_blk_t *)(fs->image + root_inode->i_indirect * VSFS_BLOCK_SIZE);
-	memset(indirect_block_number, VSFS_BLK_UNASSIGNED, fs->num_blk_per_b);
-
-	return allocate_block(superblock->sb_num_blocks, indirect_block_number, new_file_inode, inode_index, path_name);
-}
-
-/** Finds and returns the block number, index of the input file name, and the number of valid blocks found if it exists. */
-uint32_t find_path_data_block(uint32_t num_blocks, vsfs_blk_t *directory_entry_array, const char *path_name, uint32_t *dentry_array_index, uint32_t *index_within_array) {
-	fs_ctx *fs = get_fs();
-	uint32_t array_index = 0;
-	uint32_t valid_blocks_found = 0;
-	while (array_index < num_blocks) {
-		if (directory_entry_array[array_index] != VSFS_BLK_UNASSIGNED) {
-			vsfs_dentry *block_head = (vsfs_dentry *)(fs->image + directory_entry_array[array_index] * VSFS_BLOCK_SIZE);
-			for (uint32_t array_entry_index = 0; array_entry_index < fs->num_d_db; ++array_entry_index) {
-				vsfs_dentry *curr_array_entry = &block_head[array_entry_index];
-				if (curr_array_entry->ino != VSFS_INO_MAX) {
-					char *curr_array_entry_name = curr_array_entry->name;
-					if (strcmp(curr_array_entry_name, path_name) == 0) {				
-						*dentry_array_index = array_index;
-						*index_within_array = array_entry_index;
-						return valid_blocks_found;
-					}
+/** 
+ * Find a free directory entry slot for the given name in the root directory, allocating a
+ * new directory block (and the indirect blocks that map it) if the slot is in a block that
+ * doesn't exist yet. Sets lblk to the position of the block in the root directory and slot to the
+ * index of the slot within the block (for a variable length directory, the offset of a record
+ * with enough free space), and returns the directory block, or NULL if the directory or the
+ * file system is full.
+ */
+vsfs_dentry *find_free_dentry_slot(fs_ctx *fs, const char *path_name, uint32_t *lblk, uint32_t *slot) {
+
+	// In a hashed directory, the entry goes to the first free slot in the chain of its home
+	// bucket, which grows by a block once all of its blocks are full
+	if (fs->hashed_dir) {
+		for (*lblk = dir_name_hash(path_name) % VSFS_HASHED_DIR_BUCKETS; *lblk < fs->root_max_blocks;
+		     *lblk += VSFS_HASHED_DIR_BUCKETS) {
+			vsfs_dentry *block_head = get_or_allocate_dentry_block(fs, *lblk);
+			if (block_head == NULL) {
+				return NULL;
+			}
+			for (*slot = 0; *slot < fs->num_d_db; ++*slot) {
+				if (block_head[*slot].ino == VSFS_INO_MAX) {
+					return block_head;
 				}
 			}
-			valid_blocks_found += 1;
 		}
-		array_index += 1;
+		return NULL;
 	}
-	*dentry_array_index = VSFS_BLK_UNASSIGNED;
-	*index_within_array = VSFS_INO_MAX;
-	return valid_blocks_found;
-}
 
-/** Checks how many directory entries are in the input array */
-uint32_t get_num_dentries_in_block(vsfs_blk_t *dentry_array, uint32_t num_blocks) {
-	fs_ctx *fs = get_fs();
-	uint32_t num_dentries = 0;
-	uint32_t dentry_array_index = 0;
+	// Otherwise use the free slot masks in the fs context. Every block before the hint is
+	// full, so the search only ever moves forward until an entry is removed from an
+	// earlier block
+	while (fs->root_free_hint < fs->root_max_blocks && fs->root_free_slots[fs->root_free_hint] == 0) {
+		fs->root_free_hint += 1;
+	}
+	if (fs->root_free_hint == fs->root_max_blocks) {
+		return NULL;
+	}
 
-	while (dentry_array_index < num_blocks) {
-		if (dentry_array[dentry_array_index] != VSFS_BLK_UNASSIGNED) {
-			vsfs_dentry *block_head = (vsfs_dentry *)(fs->image + dentry_array[dentry_array_index] * VSFS_BLOCK_SIZE);
-			for (uint32_t i = 0; i < num_blocks; ++i) {
-				vsfs_dentry *curr_dentry = &block_head[i];
-				if (curr_dentry->ino != VSFS_INO_MAX) {
-					num_dentries += 1;
+	// A variable length entry needs a block with a large enough free record, which need
+	// not be the first block with any free space at all
+	if (fs->var_len_dir) {
+		uint32_t rec_len = VSFS_DENTRY_VAR_LEN(strlen(path_name));
+		for (*lblk = fs->root_free_hint; *lblk < fs->root_max_blocks; ++*lblk) {
+			if (fs->root_free_slots[*lblk] >= rec_len) {
+				void *block = get_or_allocate_dentry_block(fs, *lblk);
+				if (block != NULL) {
+					*slot = dentry_var_find_space(block, rec_len);
+					assert(*slot < VSFS_BLOCK_SIZE);
 				}
+				return block;
 			}
 		}
-		dentry_array_index += 1;
+		return NULL;
 	}
 
-	return num_dentries;
+	*lblk = fs->root_free_hint;
+	*slot = __builtin_ctz(fs->root_free_slots[*lblk]);
+	return get_or_allocate_dentry_block(fs, *lblk);
 }
 
-/** Unlinks the data blocks from an inode, both direct and indirect */
-uint32_t unlink_data_blocks(uint32_t num_blocks, vsfs_blk_t *dentry_array) {
-	fs_ctx *fs = get_fs();
-	vsfs_superblock *superblock = fs->sb;
-	bitmap_t *data_bitmap = fs->dbmap;
-
-	uint32_t path_array_index = 0;
-	uint32_t blocks_freed = 0;
-	while (path_array_index < num_blocks) {
-		if (dentry_array[path_array_index] != VSFS_BLK_UNASSIGNED) {
-			vsfs_dentry *block_head = (vsfs_dentry *)(fs->image + dentry_array[path_array_index] * VSFS_BLOCK_SIZE);
-			for (uint32_t path_array_entry_index = 0; path_array_entry_index < fs->num_d_db; ++path_array_entry_index) {
-				vsfs_dentry *curr_array_entry = &block_head[path_array_entry_index];
-				if (curr_array_entry->ino != VSFS_INO_MAX) {
-					curr_array_entry->ino = VSFS_INO_MAX;
+/** 
+ * Release the empty blocks at the end of the chain of the hashed root directory bucket that the
+ * block at position lblk is in, starting from that block if it ends the chain, along with the
+ * indirect blocks (and the double indirect block) that no longer map any directory blocks.
+ */
+static void trim_hashed_dir_chain(fs_ctx *fs, uint32_t lblk) {
+	vsfs_inode *root_inode = fs_inode(fs, VSFS_ROOT_INO);
+	uint32_t double_first = double_indirect_first(fs);
+
+	// A lookup stops at the first missing block, so only the last block of a chain can go
+	if (lblk + VSFS_HASHED_DIR_BUCKETS < fs->root_max_blocks) {
+		vsfs_blk_t *next_block_number = root_dentry_block_number(fs, lblk + VSFS_HASHED_DIR_BUCKETS);
+		if (next_block_number != NULL && *next_block_number != VSFS_BLK_UNASSIGNED) {
+			return;
+		}
+	}
+
+	for (;;) {
+		vsfs_blk_t *block_number = root_dentry_block_number(fs, lblk);
+		vsfs_dentry *block_head = (vsfs_dentry *)fs_block(fs, *block_number);
+		for (uint32_t slot = 0; slot < fs->num_d_db; ++slot) {
+			if (block_head[slot].ino != VSFS_INO_MAX) {
+				return;
+			}
+		}
+		free_data_block(fs, *block_number);
+		*block_number = VSFS_BLK_UNASSIGNED;
+		root_inode->i_blocks -= 1;
+		root_inode->i_size -= VSFS_BLOCK_SIZE;
+
+		if (lblk >= double_first) {
+			vsfs_blk_t *indirect_blocks = (vsfs_blk_t *)fs_block(fs, root_inode->i_double_indirect);
+			uint32_t index = (lblk - double_first) / fs->num_blk_per_b;
+			if (count_assigned(fs_block(fs, indirect_blocks[index]), fs->num_blk_per_b) == 0) {
+				free_data_block(fs, indirect_blocks[index]);
+				indirect_blocks[index] = VSFS_BLK_UNASSIGNED;
+				if (count_assigned(indirect_blocks, fs->num_blk_per_b) == 0) {
+					free_data_block(fs, root_inode->i_double_indirect);
+					root_inode->i_double_indirect = VSFS_BLK_UNASSIGNED;
 				}
 			}
-			blocks_freed += 1;
-			bitmap_free(data_bitmap, superblock->sb_num_blocks, dentry_array[path_array_index]);
-			dentry_array[path_array_index] = VSFS_BLK_UNASSIGNED;
-			superblock->sb_free_blocks += 1;
 		}
-		path_array_index += 1;
+		else if (lblk >= VSFS_NUM_DIRECT &&
+		         count_assigned(fs_block(fs, root_inode->i_indirect), fs->num_blk_per_b) == 0) {
+			free_data_block(fs, root_inode->i_indirect);
+			root_inode->i_indirect = VSFS_BLK_UNASSIGNED;
+		}
+
+		// The chain has no gaps, so the block before this one exists
+		if (lblk < VSFS_HASHED_DIR_BUCKETS) {
+			return;
+		}
+		lblk -= VSFS_HASHED_DIR_BUCKETS;
 	}
-	return blocks_freed;
 }
 
-/** Unlinks the entire input file */
-int unlink_entire_file(vsfs_dentry *path_dentry, vsfs_inode *path_file_inode, uint32_t array_index, uint32_t path_inode_index) {
-	fs_ctx *fs = get_fs();
+/** 
+ * Remove the entry at the given location from the root directory and drop the link count of its
+ * inode, releasing the directory block if it is left empty. The inode itself is not freed.
+ */
+int remove_dir_entry(fs_ctx *fs, const dir_index_entry *path_entry) {
 	vsfs_superblock *superblock = fs->sb;
-	bitmap_t *inode_bitmap = fs->ibmap;
-	bitmap_t *data_bitmap = fs->dbmap;
-	vsfs_inode *itable = fs->itable;
-	vsfs_inode *root_inode = &itable[VSFS_ROOT_INO];
-
-	path_dentry->ino = VSFS_INO_MAX;
-	path_file_inode->i_nlink -= 1;
-	bitmap_free(inode_bitmap, div_round_up(VSFS_BLOCK_SIZE, sizeof(vsfs_inode)), path_inode_index);
-	superblock->sb_free_inodes += 1;
+	bitmap_summary *data_bitmap = &fs->dbmap_summary;
+	vsfs_inode *root_inode = fs_inode(fs, VSFS_ROOT_INO);
 
-	if (path_file_inode->i_blocks > 0) {
-		uint32_t direct_blocks_freed = unlink_data_blocks(VSFS_NUM_DIRECT, path_file_inode->i_direct);
+	uint32_t path_inode_index = path_entry->ino;
+	vsfs_inode *path_file_inode = fs_inode(fs, path_inode_index);
+	vsfs_dentry *path_block = (vsfs_dentry *)fs_block(fs, path_entry->blk);
+	uint32_t path_lblk = path_entry->lblk;
 
-		if (direct_blocks_freed < path_file_inode->i_blocks && path_file_inode->i_indirect != VSFS_BLK_UNASSIGNED) {
-			uint32_t num_indirect_blocks = path_file_inode->i_blocks - direct_blocks_freed;
-			vsfs_blk_t *path_indirect_block_number = (vsfs_blk_t *)(fs->image + path_file_inode->i_indirect * VSFS_BLOCK_SIZE);
-			unlink_data_blocks(num_indirect_blocks, path_indirect_block_number);
-			
-			bitmap_free(data_bitmap, superblock->sb_num_blocks, path_file_inode->i_indirect);
-			*path_indirect_block_number = VSFS_BLK_UNASSIGNED;
-			superblock->sb_free_blocks += 1;
+	if (fs->var_len_dir) {
+		vsfs_dentry_var *rec = dentry_var_at(path_block, path_entry->slot);
+		dir_index_remove(&fs->root_index, dir_index_find(&fs->root_index, rec->name));
+		dentry_var_remove(path_block, path_entry->slot);
+		fs->root_free_slots[path_lblk] = dentry_var_free_space(path_block);
+		if (path_lblk < fs->root_free_hint) {
+			fs->root_free_hint = path_lblk;
+		}
+	}
+	else {
+		if (!fs->hashed_dir) {
+			dir_index_remove(&fs->root_index, dir_index_find(&fs->root_index, path_block[path_entry->slot].name));
+			fs->root_free_slots[path_lblk] |= (uint32_t)1 << path_entry->slot;
+			if (path_lblk < fs->root_free_hint) {
+				fs->root_free_hint = path_lblk;
+			}
 		}
+		path_block[path_entry->slot].ino = VSFS_INO_MAX;
 	}
+	path_file_inode->i_nlink -= 1;
 
-	if (get_num_dentries_in_block(&(root_inode->i_direct[array_index]), VSFS_NUM_DIRECT) == 0) {
-		bitmap_free(data_bitmap, superblock->sb_num_blocks, root_inode->i_direct[array_index]);
-		root_inode->i_direct[array_index] = VSFS_BLK_UNASSIGNED;
+	// A hashed directory only releases blocks from the end of a bucket's chain. Otherwise any
+	// block left empty goes; the first directory block holds "." and ".." so it never is.
+	if (fs->hashed_dir) {
+		trim_hashed_dir_chain(fs, path_lblk);
+	}
+	else if (path_lblk != 0 && (fs->var_len_dir ? dentry_var_block_empty(path_block)
+	                                            : fs->root_free_slots[path_lblk] == fs->dentry_slots_mask)) {
+		vsfs_blk_t *indirect_block_number = (vsfs_blk_t *)fs_block(fs, root_inode->i_indirect);
+		vsfs_blk_t *path_block_number = root_dentry_block_number(fs, path_lblk);
+		bitmap_summary_free(data_bitmap, *path_block_number);
+		*path_block_number = VSFS_BLK_UNASSIGNED;
 		root_inode->i_blocks -= 1;
 		root_inode->i_size -= VSFS_BLOCK_SIZE;
 		superblock->sb_free_blocks += 1;
+
+		// Release the indirect block once it no longer points to any directory blocks
+		if (path_lblk >= VSFS_NUM_DIRECT && last_block_in_file(fs->num_blk_per_b, indirect_block_number) == VSFS_INO_MAX) {
+			bitmap_summary_free(data_bitmap, root_inode->i_indirect);
+			root_inode->i_indirect = VSFS_BLK_UNASSIGNED;
+			superblock->sb_free_blocks += 1;
+		}
 	}
 
 	if (clock_gettime(CLOCK_REALTIME, &(root_inode->i_mtime)) != 0) {
@@ -306,64 +1331,520 @@ int unlink_entire_file(vsfs_dentry *path_dentry, vsfs_inode *path_file_inode, ui
 	return 0;
 }
 
-int allocate_empty_file_block(uint32_t num_blocks, vsfs_blk_t *dentry_array, vsfs_inode *path_file_inode) {
-
-	fs_ctx *fs = get_fs();
+/** Free an inode that has no links left, along with its data blocks. */
+void free_inode(fs_ctx *fs, vsfs_ino_t ino) {
 	vsfs_superblock *superblock = fs->sb;
-	bitmap_t *data_bitmap = fs->dbmap;
-	
-	uint32_t next_avail_index = VSFS_BLK_UNASSIGNED;
-	int err = find_available_entry(num_blocks, dentry_array, &next_avail_index);
-
-	if (!err) {
-		uint32_t next_data_bitmap_index;
-		allocate_bitmap_index(data_bitmap, superblock->sb_num_blocks, &next_data_bitmap_index);
-		superblock->sb_free_blocks -= 1;
-
-		dentry_array[next_avail_index] = next_data_bitmap_index;
-		vsfs_blk_t *add_to_array = (vsfs_blk_t *)(fs->image + dentry_array[next_avail_index] * VSFS_BLOCK_SIZE);
-		memset(add_to_array, VSFS_BLK_UNASSIGNED, VSFS_BLOCK_SIZE);
-		path_file_inode->i_blocks += 1;
-		path_file_inode->i_size += VSFS_BLOCK_SIZE;
-		return 0;
+
+	int err = truncate_inode(fs, ino, 0);
+	assert(!err);
+	bitmap_summary_free(&fs->ibmap_summary, ino);
+	superblock->sb_free_inodes += 1;
+}
+
+/** Unlinks the entire input file, given the location of its entry in the root directory */
+int unlink_entire_file(fs_ctx *fs, const dir_index_entry *path_entry) {
+	vsfs_ino_t ino = path_entry->ino;
+	int err = remove_dir_entry(fs, path_entry);
+	if (err != 0) {
+		return err;
 	}
-	return -1;
+	free_inode(fs, ino);
+	return 0;
 }
 
 uint32_t last_block_in_file(uint32_t num_blocks, vsfs_blk_t *dentry_array) {
-	for (uint32_t path_array_index = num_blocks - 1; path_array_index > 0; --path_array_index) {
-		if (dentry_array[path_array_index] != VSFS_BLK_UNASSIGNED) {
-			return path_array_index;
+	for (uint32_t path_array_index = num_blocks; path_array_index > 0; --path_array_index) {
+		if (dentry_array[path_array_index - 1] != VSFS_BLK_UNASSIGNED) {
+			return path_array_index - 1;
 		}
 	}
 	return VSFS_INO_MAX;
 }
 
-uint32_t remove_eof(uint32_t array_size, uint32_t num_blocks_to_remove, vsfs_blk_t *dentry_array, vsfs_inode *path_file_inode) {
-	fs_ctx *fs = get_fs();
+/** Fill in the file system statistics (see vsfs_statfs()). */
+void fill_statvfs(fs_ctx *fs, struct statvfs *st) {
+	vsfs_superblock *sb = fs->sb;
+
+	memset(st, 0, sizeof(*st));
+	st->f_bsize   = VSFS_BLOCK_SIZE;      /* Filesystem block size */
+	st->f_frsize  = VSFS_BLOCK_SIZE;      /* Fragment size */
+	st->f_blocks  = sb->sb_num_blocks;    /* Size of fs in f_frsize units */
+	// The blocks reserved ahead of appends are free on disk, and given back when needed
+	st->f_bfree   = sb->sb_free_blocks;   /* Number of free blocks */
+	st->f_bavail  = sb->sb_free_blocks;   /* Free blocks for unpriv users */
+	st->f_files   = sb->sb_num_inodes;    /* Number of inodes */
+	st->f_ffree   = sb->sb_free_inodes;   /* Number of free inodes */
+	st->f_favail  = sb->sb_free_inodes;   /* Free inodes for unpriv users */
+	st->f_namemax = VSFS_NAME_MAX;        /* Maximum filename length */
+}
+
+/** 
+ * Gather fragmentation statistics: how many extents (runs of contiguous blocks) the data of the
+ * regular files is split into, and how the free blocks are split up.
+ */
+void fill_frag_stats(fs_ctx *fs, frag_stats *st) {
+	vsfs_superblock *sb = fs->sb;
+
+	memset(st, 0, sizeof(*st));
+	for (vsfs_ino_t ino = 0; ino < sb->sb_num_inodes; ++ino) {
+		vsfs_inode *inode = fs_inode(fs, ino);
+		if (!bitmap_isset(fs->ibmap, sb->sb_num_inodes, ino) || !S_ISREG(inode->i_mode) ||
+		    inode->i_blocks == 0) {
+			continue;
+		}
+		// Holes are skipped, so a sparse file is only fragmented if its data is
+		uint32_t extents = 0;
+		uint32_t blocks = 0;
+		for (uint32_t lblk = 0, len; lblk < inode->i_blocks; lblk += len) {
+			if (inode_map_block(fs, inode, lblk, &len) != VSFS_BLK_UNASSIGNED) {
+				extents += 1;
+				blocks += len;
+			}
+		}
+		st->files += 1;
+		st->fragmented_files += (extents > 1);
+		st->blocks += blocks;
+		st->extents += extents;
+	}
+
+	uint32_t free_run = 0;
+	for (uint64_t blk = 0; blk <= sb->sb_num_blocks; ++blk) {
+		if (blk < sb->sb_num_blocks && !bitmap_isset(fs->dbmap, sb->sb_num_blocks, blk)) {
+			free_run += 1;
+		} else if (free_run != 0) {
+			st->free_extents += 1;
+			if (free_run > st->largest_free_extent) {
+				st->largest_free_extent = free_run;
+			}
+			free_run = 0;
+		}
+	}
+}
+
+/** 
+ * Create an empty regular file with the given name and mode in the root directory, and set ino
+ * to its inode number. The name must not exist yet. Returns 0 on success, -ENOSPC if there is no
+ * free inode or no room for the entry, or -ENOMEM if the name index can't grow.
+ */
+int create_file(fs_ctx *fs, const char *name, mode_t mode, vsfs_ino_t *ino) {
 	vsfs_superblock *superblock = fs->sb;
-	bitmap_t *data_bitmap = fs->dbmap;
-
-	uint32_t path_array_index = last_block_in_file(array_size, dentry_array);
-	assert(path_array_index != VSFS_INO_MAX);
-	uint32_t blocks_freed = 0;
-	while (path_array_index < array_size) {
-		if (dentry_array[path_array_index] != VSFS_BLK_UNASSIGNED) {
-			vsfs_dentry *block_head = (vsfs_dentry *)(fs->image + dentry_array[path_array_index] * VSFS_BLOCK_SIZE);
-			memset(block_head, VSFS_BLK_UNASSIGNED, VSFS_BLOCK_SIZE);
-			blocks_freed += 1;
-			bitmap_free(data_bitmap, superblock->sb_num_blocks, dentry_array[path_array_index]);
-			dentry_array[path_array_index] = VSFS_BLK_UNASSIGNED;
-			superblock->sb_free_blocks += 1;
 
-			path_file_inode->i_blocks -= 1;
-			path_file_inode->i_size -= VSFS_BLOCK_SIZE;
+	// Check if there is space in the file system for a new file
+	if (superblock->sb_free_inodes == 0 || !have_free_blocks(fs, 1)) {
+		return -ENOSPC;
+	}
+
+	// Make sure the new entry can be added to the root directory name index
+	if (!fs->hashed_dir && !dir_index_reserve(&fs->root_index, fs->root_index.count + 1)) {
+		return -ENOMEM;
+	}
+
+	// Find a free slot for the new file's entry in the root directory, adding a
+	// directory block if all the existing ones are full
+	uint32_t dentry_lblk;
+	uint32_t dentry_slot;
+	vsfs_dentry *dentry_block = find_free_dentry_slot(fs, name, &dentry_lblk, &dentry_slot);
+	if (dentry_block == NULL) {
+		return -ENOSPC;
+	}
+
+	// Then allocate space in the inode bitmap for the new file
+	bitmap_summary *inode_bitmap = &fs->ibmap_summary;
+	uint32_t next_inode_bitmap_index;
+	fs->ibmap_cursor = inode_search_start(fs);
+	allocate_bitmap_index(inode_bitmap, &fs->ibmap_cursor, &next_inode_bitmap_index);
+	superblock->sb_free_inodes -= 1;
+
+	// Now create and initialize the fields of the new file as a vsfs_inode
+	vsfs_inode *new_file_inode = fs_inode(fs, next_inode_bitmap_index);
+	new_file_inode->i_mode = mode;
+	new_file_inode->i_nlink = 1;
+	new_file_inode->i_blocks = 0;
+	new_file_inode->i_num_extents = 0;
+	new_file_inode->i_size = 0;
+	memset(new_file_inode->i_direct, VSFS_BLK_UNASSIGNED, VSFS_NUM_DIRECT * sizeof(vsfs_blk_t));
+	new_file_inode->i_indirect = VSFS_BLK_UNASSIGNED;
+	if (clock_gettime(CLOCK_REALTIME, &(new_file_inode->i_mtime)) != 0) {
+		perror("clock_gettime");
+		return -ENOSYS;
+	}
+
+	// Finally, add the new file's entry to the slot we found
+	*ino = next_inode_bitmap_index;
+	return add_entry_to_block(fs, dentry_block, dentry_slot, dentry_lblk, new_file_inode, next_inode_bitmap_index, name);
+}
+
+/** 
+ * Allocate the state of a newly opened file with the given inode. Returns NULL if out of memory.
+ */
+open_file *open_file_new(vsfs_ino_t ino) {
+	open_file *file = malloc(sizeof(open_file));
+	if (file != NULL) {
+		file->ino = ino;
+		file->map = NULL;
+	}
+	return file;
+}
+
+/** 
+ * Free the state of an open file that is being closed, along with the block map cache of its
+ * inode if no other open file uses it.
+ */
+void open_file_free(fs_ctx *fs, open_file *file) {
+	block_map_cache *map = file->map;
+	if (map != NULL && --map->refs == 0) {
+		trim_prealloc(fs, map);
+		block_map_cache **link = &fs->map_caches[map->ino % VSFS_MAP_CACHE_BUCKETS];
+		while (*link != map) {
+			link = &(*link)->next;
+		}
+		*link = map->next;
+		free(map->blocks);
+		free(map);
+	}
+	free(file);
+}
+
+/** 
+ * Like file_map_block(), but also set len to the number of blocks from lblk on (at most max) that
+ * are contiguous on disk, or in the same hole, so that they can be copied at once.
+ */
+static vsfs_blk_t file_map_run(fs_ctx *fs, open_file *file, vsfs_inode *inode, uint32_t lblk, uint32_t max, uint32_t *len) {
+	vsfs_blk_t first = file_map_block(fs, file, inode, lblk);
+	if (first == VSFS_BLK_UNASSIGNED) {
+		// Holes aren't cached, so their length comes from the inode
+		inode_map_run(fs, inode, lblk, max, len);
+		return first;
+	}
+	*len = 1;
+	while (*len < max && file_map_block(fs, file, inode, lblk + *len) == first + *len) {
+		*len += 1;
+	}
+	return first;
+}
+
+/** 
+ * Copy the size bytes at offset of the given open file, which must be within its end of file,
+ * from the file into buf, or from buf into the file if to_file is set.
+ * Each run of blocks that are contiguous on disk is copied with a single memcpy(). Holes read as
+ * zeros; the range written to must not have any.
+ */
+static void copy_file_data(fs_ctx *fs, open_file *file, vsfs_inode *inode, char *buf, size_t size, uint64_t offset, bool to_file) {
+	for (size_t done = 0; done < size; ) {
+		uint64_t pos = offset + done;
+		uint32_t skip = pos % VSFS_BLOCK_SIZE;
+		uint32_t max_blocks = div_round_up(skip + (size - done), VSFS_BLOCK_SIZE);
+		uint32_t len;
+		vsfs_blk_t block_number = file_map_run(fs, file, inode, pos / VSFS_BLOCK_SIZE, max_blocks, &len);
+
+		size_t chunk = (size_t)len * VSFS_BLOCK_SIZE - skip;
+		if (chunk > size - done) {
+			chunk = size - done;
+		}
+		if (block_number == VSFS_BLK_UNASSIGNED) {
+			assert(!to_file);
+			memset(buf + done, 0, chunk);
+		}
+		else if (to_file) {
+			memcpy(fs_block(fs, block_number) + skip, buf + done, chunk);
+		}
+		else {
+			memcpy(buf + done, fs_block(fs, block_number) + skip, chunk);
+		}
+		done += chunk;
+	}
+}
+
+/** 
+ * Read up to size bytes at offset from the given open file into buf (see copy_file_data()).
+ * Returns the number of bytes read, which is 0 at or past the end of file.
+ */
+int read_inode(fs_ctx *fs, open_file *file, char *buf, size_t size, off_t offset) {
+	vsfs_inode *path_file_inode = fs_inode(fs, file->ino);
+	if (offset >= (off_t)path_file_inode->i_size) {
+		return 0;
+	}
+
+	size_t size_read = size;
+	if (path_file_inode->i_size < offset + size) {
+		size_read = path_file_inode->i_size - offset;
+	}
+
+	if (inode_is_inline(fs, path_file_inode)) {
+		memcpy(buf, inode_inline_data(path_file_inode) + offset, size_read);
+		return (int)size_read;
+	}
+	copy_file_data(fs, file, path_file_inode, buf, size_read, offset, false);
+	return (int)size_read;
+}
+
+/** 
+ * Free a buffer vector built by file_bufvec() or read_inode_buf(), along with the memory of its
+ * buffers, like FUSE does with the buffer vectors that read_buf returns.
+ */
+void free_bufvec(struct fuse_bufvec *bufv) {
+	for (size_t i = 0; i < bufv->count; ++i) {
+		free(bufv->buf[i].mem);
+	}
+	free(bufv);
+}
+
+/** 
+ * Build a buffer vector for the size bytes at offset of the given open file, which must be within
+ * its end of file and not inline, with one buffer for each run of blocks that are contiguous on
+ * disk. The buffers refer to the runs by their offset in the image file (fs->image_fd), so that
+ * FUSE can splice data to or from them. Holes get zeroed buffers in memory. The vector must be
+ * freed with free_bufvec(). Returns 0 on success, or -ENOMEM.
+ */
+static int file_bufvec(fs_ctx *fs, open_file *file, vsfs_inode *inode, size_t size, uint64_t offset, struct fuse_bufvec **bufp) {
+	// Each block starts at most one run
+	size_t max_runs = (size == 0) ? 1 : div_round_up(offset % VSFS_BLOCK_SIZE + size, VSFS_BLOCK_SIZE);
+	struct fuse_bufvec *bufv = malloc(sizeof(*bufv) + (max_runs - 1) * sizeof(struct fuse_buf));
+	if (bufv == NULL) {
+		return -ENOMEM;
+	}
+	*bufv = FUSE_BUFVEC_INIT(0);
+	if (size != 0) {
+		bufv->count = 0;
+	}
+
+	for (size_t done = 0; done < size; ) {
+		uint64_t pos = offset + done;
+		uint32_t skip = pos % VSFS_BLOCK_SIZE;
+		uint32_t max_blocks = div_round_up(skip + (size - done), VSFS_BLOCK_SIZE);
+		uint32_t len;
+		vsfs_blk_t block_number = file_map_run(fs, file, inode, pos / VSFS_BLOCK_SIZE, max_blocks, &len);
+
+		size_t chunk = (size_t)len * VSFS_BLOCK_SIZE - skip;
+		if (chunk > size - done) {
+			chunk = size - done;
+		}
+		struct fuse_buf *buf = &bufv->buf[bufv->count++];
+		*buf = (struct fuse_buf){ .size = chunk, .flags = 0, .mem = NULL, .fd = -1, .pos = 0 };
+		if (block_number == VSFS_BLK_UNASSIGNED) {
+			buf->mem = calloc(1, chunk);
+			if (buf->mem == NULL) {
+				free_bufvec(bufv);
+				return -ENOMEM;
+			}
+		}
+		else {
+			buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			buf->fd = fs->image_fd;
+			buf->pos = (off_t)block_number * VSFS_BLOCK_SIZE + skip;
+		}
+		done += chunk;
+	}
+	*bufp = bufv;
+	return 0;
+}
+
+/** 
+ * Like read_inode(), but instead of copying the data, return a buffer vector in bufp that refers
+ * to the blocks read by their offset in the image file (see file_bufvec()), so that FUSE can
+ * splice them into its reply. Only holes and inline data get buffers in memory. The vector must
+ * be freed with free_bufvec(). Returns 0 on success, or -ENOMEM.
+ */
+int read_inode_buf(fs_ctx *fs, open_file *file, size_t size, off_t offset, struct fuse_bufvec **bufp) {
+	vsfs_inode *inode = fs_inode(fs, file->ino);
+	size_t size_read = 0;
+	if (offset < (off_t)inode->i_size) {
+		size_read = (inode->i_size < offset + size) ? inode->i_size - offset : size;
+	}
+	if (size_read == 0 || !inode_is_inline(fs, inode)) {
+		return file_bufvec(fs, file, inode, size_read, offset, bufp);
+	}
+
+	struct fuse_bufvec *bufv = malloc(sizeof(*bufv));
+	if (bufv == NULL) {
+		return -ENOMEM;
+	}
+	*bufv = FUSE_BUFVEC_INIT(size_read);
+	bufv->buf[0].mem = malloc(size_read);
+	if (bufv->buf[0].mem == NULL) {
+		free_bufvec(bufv);
+		return -ENOMEM;
+	}
+	memcpy(bufv->buf[0].mem, inode_inline_data(inode) + offset, size_read);
+	*bufp = bufv;
+	return 0;
+}
+
+/** 
+ * Get the given inode's file ready for writing size bytes at offset: extend the file (with a hole
+ * up to offset) first if the write goes past its end, allocate all of the blocks written to that
+ * are in holes at once (see fill_holes()), and update the modification time. If only some of the
+ * blocks could be allocated, size is cut down to stop before the first one that couldn't. Returns
+ * 0 on success, or -errno as for truncate_inode() and fill_holes() if nothing can be written, in
+ * which case the file is left as it was.
+ */
+static int begin_write(fs_ctx *fs, vsfs_ino_t ino, vsfs_inode *inode, size_t *size, off_t offset) {
+	uint64_t old_size = inode->i_size;
+	if (old_size < offset + *size) {
+		int err = truncate_inode(fs, ino, offset + *size);
+		if (err != 0) {
+			return err;
+		}
+	}
+
+	if (!inode_is_inline(fs, inode)) {
+		uint32_t filled;
+		int err = fill_holes(fs, ino, inode, offset, *size, &filled);
+		if (err != 0) {
+			uint64_t filled_end = (uint64_t)filled * VSFS_BLOCK_SIZE;
+			*size = (filled_end > (uint64_t)offset) ? filled_end - offset : 0;
+			uint64_t new_size = (*size != 0 && offset + *size > old_size) ? offset + *size : old_size;
+			if (inode->i_size != new_size) {
+				int ret = truncate_inode(fs, ino, new_size);
+				assert(!ret);
+			}
+			if (*size == 0) {
+				return err;
+			}
+		}
+	}
+	if (clock_gettime(CLOCK_REALTIME, &(inode->i_mtime)) != 0) {
+		perror("clock_gettime");
+		return -ENOSYS;
+	}
+	return 0;
+}
+
+/** 
+ * Write size bytes from buf at offset into the given open file (see begin_write()). If only some
+ * of the blocks written to could be allocated, the write stops short before the first one that
+ * couldn't. Returns the number of bytes written, or -errno if nothing could be written, in which
+ * case the file is left as it was.
+ */
+int write_inode(fs_ctx *fs, open_file *file, const char *buf, size_t size, off_t offset) {
+	vsfs_inode *path_file_inode = fs_inode(fs, file->ino);
+	int err = begin_write(fs, file->ino, path_file_inode, &size, offset);
+	if (err != 0) {
+		return err;
+	}
+
+	if (inode_is_inline(fs, path_file_inode)) {
+		memcpy(inode_inline_data(path_file_inode) + offset, buf, size);
+	}
+	else {
+		copy_file_data(fs, file, path_file_inode, (char *)buf, size, offset, true);
+	}
+	return (int)size;
+}
+
+/** 
+ * Find the holes among the blocks written to by a write of size bytes at offset into the given
+ * inode's file that are within its end of file. On return, holes is NULL if there are none, or a
+ * bitmap (to be freed) with a bit set for each block in a hole, counting from the one at offset.
+ * Returns 0 on success, or -ENOMEM.
+ */
+static int find_write_holes(fs_ctx *fs, vsfs_inode *inode, size_t size, off_t offset, bitmap_t **holes) {
+	uint32_t first = offset / VSFS_BLOCK_SIZE;
+	uint64_t end = ((uint64_t)offset + size + VSFS_BLOCK_SIZE - 1) / VSFS_BLOCK_SIZE;
+	if (end > inode->i_blocks) {
+		end = inode->i_blocks;
+	}
 
-			if (blocks_freed == num_blocks_to_remove) {
-				return blocks_freed;
+	*holes = NULL;
+	for (uint32_t lblk = first, len; lblk < end; lblk += len) {
+		if (inode_map_run(fs, inode, lblk, end - lblk, &len) != VSFS_BLK_UNASSIGNED) {
+			continue;
+		}
+		if (*holes == NULL) {
+			uint32_t bits_per_word = sizeof(bitmap_t) * CHAR_BIT;
+			*holes = calloc(div_round_up(end - first, bits_per_word), sizeof(bitmap_t));
+			if (*holes == NULL) {
+				return -ENOMEM;
 			}
 		}
-		path_array_index -= 1;
+		for (uint32_t i = 0; i < len; ++i) {
+			bitmap_set(*holes, end - first, lblk + i - first, true);
+		}
+	}
+	return 0;
+}
+
+/** 
+ * Zero the bytes from stop up to end that a write at offset which stopped short at stop left
+ * unwritten in the blocks that were holes before the write (see find_write_holes()). End is the
+ * end of the write or the old end of file, whichever comes first; everything past the old end of
+ * file is cut off again, and the other blocks still hold the data they had before the write.
+ */
+static void zero_write_holes(fs_ctx *fs, open_file *file, vsfs_inode *inode, bitmap_t *holes, off_t offset, uint64_t stop, uint64_t end) {
+	uint32_t first = offset / VSFS_BLOCK_SIZE;
+	uint32_t end_blk = (end + VSFS_BLOCK_SIZE - 1) / VSFS_BLOCK_SIZE;
+	for (uint32_t lblk = stop / VSFS_BLOCK_SIZE; lblk < end_blk; ++lblk) {
+		if (!bitmap_isset(holes, end_blk - first, lblk - first)) {
+			continue;
+		}
+		// The rest of the write may not have been allocated at all
+		vsfs_blk_t block_number = file_map_block(fs, file, inode, lblk);
+		if (block_number == VSFS_BLK_UNASSIGNED) {
+			continue;
+		}
+		uint64_t block_start = (uint64_t)lblk * VSFS_BLOCK_SIZE;
+		uint64_t from = (stop > block_start) ? stop : block_start;
+		uint64_t to = (end < block_start + VSFS_BLOCK_SIZE) ? end : block_start + VSFS_BLOCK_SIZE;
+		memset(fs_block(fs, block_number) + (from - block_start), 0, to - from);
 	}
-	return blocks_freed;
-}
\ No newline at end of file
+}
+
+/** 
+ * Like write_inode(), but take the data from a FUSE buffer vector, which may refer to a pipe, and
+ * copy it with fuse_buf_copy() straight to the blocks written to by their offset in the image file
+ * (see file_bufvec()), so that it can be spliced. If the copy fails part of the way, the write
+ * stops short there: the file ends at the end of what was written if that is past its old end,
+ * and what is left of the blocks the write filled holes with reads back as zeros again. Data that
+ * was in the file before is never touched. Returns the number of bytes written, or -errno if
+ * nothing could be written.
+ */
+int write_inode_buf(fs_ctx *fs, open_file *file, struct fuse_bufvec *bufv, off_t offset) {
+	vsfs_inode *inode = fs_inode(fs, file->ino);
+	uint64_t old_size = inode->i_size;
+	size_t size = fuse_buf_size(bufv);
+	uint64_t end = (offset + size < old_size) ? offset + size : old_size;
+	bitmap_t *holes;
+	int err = find_write_holes(fs, inode, size, offset, &holes);
+	if (err == 0) {
+		err = begin_write(fs, file->ino, inode, &size, offset);
+	}
+	if (err != 0) {
+		free(holes);
+		return err;
+	}
+
+	// Only the first size bytes are taken from bufv if the write was cut short
+	ssize_t copied;
+	if (inode_is_inline(fs, inode)) {
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+		dst.buf[0].mem = inode_inline_data(inode) + offset;
+		copied = fuse_buf_copy(&dst, bufv, 0);
+	}
+	else {
+		struct fuse_bufvec *dst;
+		copied = file_bufvec(fs, file, inode, size, offset, &dst);
+		if (copied == 0) {
+			copied = fuse_buf_copy(dst, bufv, 0);
+			free_bufvec(dst);
+		}
+	}
+
+	size_t written = (copied > 0) ? copied : 0;
+	if (written < size) {
+		// An inline file has no holes: it was extended with zeros
+		uint64_t stop = offset + written;
+		if (holes != NULL && stop < end) {
+			zero_write_holes(fs, file, inode, holes, offset, stop, end);
+		}
+		uint64_t new_size = (written != 0 && stop > old_size) ? stop : old_size;
+		if (inode->i_size > new_size) {
+			int ret = truncate_inode(fs, file->ino, new_size);
+			assert(!ret);
+		}
+	}
+	free(holes);
+	if (written != 0 || size == 0) {
+		return (int)written;
+	}
+	return (copied < 0) ? (int)copied : -EIO;
+}
@@ -1,4 +1,9 @@
-/** This file contains all of the helper function definitions used in vsfs.c. */
+/** 
+ * This file contains the file system operations shared by the high level (vsfs.c) and low level
+ * (vsfs_ll.c) FUSE front ends: inode and block mapping, allocation, the root directory in each of
+ * its formats, and reading and writing open files (open_file), along with the statistics they
+ * report (frag_stats).
+ */
 
 #pragma once
 #include <assert.h>
@@ -13,41 +18,97 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/statvfs.h>
 
 #include "fs_ctx.h"
 #include "options.h"
 #include "util.h"
 #include "bitmap.h"
+#include "dentry_var.h"
 #include "map.h"
 
-fs_ctx *get_fs(void);
+void fill_inode_stat(fs_ctx *fs, vsfs_ino_t ino, struct stat *st);
 
-uint32_t get_path_inode(uint32_t num_blocks, vsfs_blk_t *directory_entry_array, const char *path_name, vsfs_ino_t *ino);
+int read_directory_entries(fs_ctx *fs, off_t offset, void *buf, fuse_fill_dir_t filler);
 
-int read_directory_entries(uint32_t num_blocks, vsfs_blk_t *directory_entry_array, void *buf, fuse_fill_dir_t filler);
+/** Fragmentation statistics (see fill_frag_stats()). */
+typedef struct frag_stats {
+	/** Number of regular files with data blocks. */
+	uint32_t files;
+	/** Number of those files whose data is in more than one extent. */
+	uint32_t fragmented_files;
+	/** Number of data blocks in those files (not counting indirect blocks). */
+	uint64_t blocks;
+	/** Number of extents (runs of contiguous blocks) of those files. */
+	uint64_t extents;
+	/** Number of runs of free blocks. */
+	uint32_t free_extents;
+	/** Length of the longest run of free blocks. */
+	uint32_t largest_free_extent;
+} frag_stats;
 
-vsfs_blk_t next_available_dentry(uint32_t num_blocks, vsfs_blk_t *directory_entry_array, uint32_t *directory_array_index_output, uint32_t *index_within_array);
+/** 
+ * State of an open file, kept in fi->fh by both FUSE front ends. Besides the inode number, it
+ * refers to the block map cache of the inode (see block_map_cache), so that reads and writes find
+ * the blocks they have seen before with a single array lookup.
+ */
+typedef struct open_file {
+	/** Inode number of the file. */
+	vsfs_ino_t ino;
+	/** Block map cache of the inode, or NULL until the first block is looked up. */
+	block_map_cache *map;
+} open_file;
 
-void allocate_bitmap_index(bitmap_t *bitmap, uint32_t size, uint32_t *found_index);
+void allocate_bitmap_index(bitmap_summary *bitmap, uint32_t *cursor, uint32_t *found_index);
 
-int find_available_entry(uint32_t num_blocks, vsfs_blk_t *dentry_array, uint32_t *block_index);
+vsfs_blk_t *inode_block_number(fs_ctx *fs, vsfs_inode *inode, uint32_t lblk);
 
-int add_entry_to_block(vsfs_dentry *add_to_array, uint32_t dentry_array_index, vsfs_inode *new_file_inode, uint32_t inode_index, const char *path_name);
+vsfs_blk_t inode_map_block(fs_ctx *fs, vsfs_inode *inode, uint32_t lblk, uint32_t *len);
 
-int allocate_block(uint32_t num_blocks, vsfs_blk_t *dentry_array, vsfs_inode *new_file_inode, uint32_t inode_index, const char *path_name);
+vsfs_blk_t allocate_zeroed_block(fs_ctx *fs, vsfs_blk_t goal);
 
-int allocate_first_indirect_block(vsfs_inode *new_file_inode, uint32_t inode_index, const char *path_name);
+void free_data_block(fs_ctx *fs, vsfs_blk_t block_number);
 
-uint32_t find_path_data_block(uint32_t num_blocks, vsfs_blk_t *directory_entry_array, const char *path_name, uint32_t *dentry_array_index, uint32_t *index_within_array);
+void trim_all_preallocs(fs_ctx *fs);
 
-uint32_t get_num_dentries_in_block(vsfs_blk_t *dentry_array, uint32_t num_blocks);
+int truncate_inode(fs_ctx *fs, vsfs_ino_t ino, off_t size);
 
-uint32_t unlink_data_blocks(uint32_t num_blocks, vsfs_blk_t *dentry_array);
+vsfs_blk_t *root_dentry_block_number(fs_ctx *fs, uint32_t lblk);
 
-int unlink_entire_file(vsfs_dentry *path_dentry, vsfs_inode *path_file_inode, uint32_t array_index, uint32_t path_inode_index);
+vsfs_dentry *get_or_allocate_dentry_block(fs_ctx *fs, uint32_t lblk);
 
-int allocate_empty_file_block(uint32_t num_blocks, vsfs_blk_t *dentry_array, vsfs_inode *path_file_inode);
+bool hashed_dir_lookup(fs_ctx *fs, const char *path_name, dir_index_entry *path_entry);
+
+bool root_dir_lookup(fs_ctx *fs, const char *path_name, dir_index_entry *path_entry);
+
+vsfs_dentry *find_free_dentry_slot(fs_ctx *fs, const char *path_name, uint32_t *lblk, uint32_t *slot);
+
+int add_entry_to_block(fs_ctx *fs, vsfs_dentry *add_to_array, uint32_t dentry_array_index, uint32_t lblk, vsfs_inode *new_file_inode, uint32_t inode_index, const char *path_name);
+
+int remove_dir_entry(fs_ctx *fs, const dir_index_entry *path_entry);
+
+void free_inode(fs_ctx *fs, vsfs_ino_t ino);
+
+int unlink_entire_file(fs_ctx *fs, const dir_index_entry *path_entry);
 
 vsfs_blk_t last_block_in_file(uint32_t num_blocks, vsfs_blk_t *dentry_array);
 
-uint32_t remove_eof(uint32_t array_size, uint32_t num_blocks_to_remove, vsfs_blk_t *dentry_array, vsfs_inode *path_file_inode);
\ No newline at end of file
+void fill_statvfs(fs_ctx *fs, struct statvfs *st);
+
+void fill_frag_stats(fs_ctx *fs, frag_stats *st);
+
+int create_file(fs_ctx *fs, const char *name, mode_t mode, vsfs_ino_t *ino);
+
+open_file *open_file_new(vsfs_ino_t ino);
+
+void open_file_free(fs_ctx *fs, open_file *file);
+
+int read_inode(fs_ctx *fs, open_file *file, char *buf, size_t size, off_t offset);
+
+void free_bufvec(struct fuse_bufvec *bufv);
+
+int read_inode_buf(fs_ctx *fs, open_file *file, size_t size, off_t offset, struct fuse_bufvec **bufp);
+
+int write_inode(fs_ctx *fs, open_file *file, const char *buf, size_t size, off_t offset);
+
+int write_inode_buf(fs_ctx *fs, open_file *file, struct fuse_bufvec *bufv, off_t offset);
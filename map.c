@@ -26,7 +26,7 @@
 #include "util.h"
 
 
-void *map_file(const char *path, size_t block_size, size_t *size)
+void *map_file(const char *path, size_t block_size, size_t *size, int *fd_out)
 {
 	// Open the file for reading and writing
 	int fd = open(path, O_RDWR);
@@ -62,6 +62,10 @@ void *map_file(const char *path, size_t block_size, size_t *size)
 	}
 	assert(is_aligned((size_t)addr, block_size));
 	*size = s.st_size;
+	if (fd_out != NULL) {
+		*fd_out = fd;
+		return addr;
+	}
 
 end:
 	//NOTE: memory mapping keeps a reference to the open file; can safely close
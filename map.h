@@ -29,7 +29,9 @@
  * @param path        image file path.
  * @param block_size  file system block size.
  * @param size        pointer to the variable that will be set to file size.
+ * @param fd          unless NULL, pointer to the variable that will be set to
+ *                    a descriptor of the file, which is then kept open.
  * @return            pointer to the file mapping in memory on success;
  *                    NULL on failure.
  */
-void *map_file(const char *path, size_t block_size, size_t *size);
+void *map_file(const char *path, size_t block_size, size_t *size, int *fd);
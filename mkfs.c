@@ -25,6 +25,8 @@
 #include "vsfs.h"
 #include "bitmap.h"
 #include "map.h"
+#include "dir_index.h"
+#include "dentry_var.h"
 
 /** Command line options. */
 typedef struct mkfs_opts {
@@ -32,6 +34,8 @@ typedef struct mkfs_opts {
 	const char *img_path;
 	/** Number of inodes. */
 	size_t n_inodes;
+	/** Inode slot size for inline data, or 0 for plain inodes. */
+	size_t inode_size;
 
 	/** Print help and exit. */
 	bool help;
@@ -39,6 +43,14 @@ typedef struct mkfs_opts {
 	bool force;
 	/** Zero out image contents. */
 	bool zero;
+	/** Use the hashed root directory format. */
+	bool hashed_dir;
+	/** Use variable length root directory entries. */
+	bool var_len_dir;
+	/** Split the image into block groups. */
+	bool block_groups;
+	/** Map regular files with extents. */
+	bool extents;
 
 } mkfs_opts;
 
@@ -53,6 +65,18 @@ Options:\n\
     -h      print help and exit\n\
     -f      force format - overwrite existing vsfs file system\n\
     -z      zero out image contents\n\
+    -H      hash root directory entries into 1024 buckets (faster lookups\n\
+            in very large directories); up to about 16.8 million entries,\n\
+            at least 16,400 in each bucket\n\
+    -V      store root directory entries as variable length records (more\n\
+            entries per block for short names); cannot be used with -H\n\
+    -G      split the image into block groups, each with its own share of\n\
+            the inode table, to keep files' inodes and data close together\n\
+    -E      map regular files' data with extents instead of block pointers\n\
+            (large contiguous files need only a few records)\n\
+    -I size inode slot size in bytes (128 to 1024, a power of 2); regular\n\
+            files small enough to fit into the rest of the slot keep their\n\
+            data inline instead of in data blocks\n\
 ";
 
 static void print_help(FILE *f, const char *progname)
@@ -64,13 +88,18 @@ static void print_help(FILE *f, const char *progname)
 static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 {
 	char o;
-	while ((o = getopt(argc, argv, "i:hfvz")) != -1) {
+	while ((o = getopt(argc, argv, "i:I:hfvzHVGE")) != -1) {
 		switch (o) {
 			case 'i': opts->n_inodes = strtoul(optarg, NULL, 10); break;
+			case 'I': opts->inode_size = strtoul(optarg, NULL, 10); break;
 
 			case 'h': opts->help  = true; return true;// skip other arguments
 			case 'f': opts->force = true; break;
 			case 'z': opts->zero  = true; break;
+			case 'H': opts->hashed_dir = true; break;
+			case 'V': opts->var_len_dir = true; break;
+			case 'G': opts->block_groups = true; break;
+			case 'E': opts->extents = true; break;
 
 			case '?': return false;
 			default : assert(false);
@@ -87,6 +116,18 @@ static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 		fprintf(stderr, "Missing or invalid number of inodes\n");
 		return false;
 	}
+
+	if (opts->hashed_dir && opts->var_len_dir) {
+		fprintf(stderr, "Options -H and -V cannot be used together\n");
+		return false;
+	}
+
+	if (opts->inode_size != 0 &&
+	    (opts->inode_size <= sizeof(vsfs_inode) || opts->inode_size > VSFS_INODE_SIZE_MAX ||
+	     (opts->inode_size & (opts->inode_size - 1)) != 0)) {
+		fprintf(stderr, "Invalid inode size\n");
+		return false;
+	}
 	return true;
 }
 
@@ -106,6 +147,66 @@ static bool vsfs_is_present(void *image)
 }
 
 
+/**
+ * Add an entry to a hashed root directory (see VSFS_HASHED_DIR_BUCKETS),
+ * allocating the first block of its bucket's chain, and the root's indirect
+ * block if that block is past the direct blocks.
+ *
+ * @param image     pointer to the start of the mmap'd disk image.
+ * @param sb        pointer to the superblock.
+ * @param dbmap     pointer to the data bitmap.
+ * @param root_ino  pointer to the root inode.
+ * @param name      name of the entry; it links to the root directory.
+ * @return          true on success; false if there is not enough space.
+ */
+static bool add_hashed_root_entry(void *image, vsfs_superblock *sb, bitmap_t *dbmap,
+                                  vsfs_inode *root_ino, const char *name)
+{
+	uint32_t bucket = dir_name_hash(name) % VSFS_HASHED_DIR_BUCKETS;
+	vsfs_blk_t *blk = &root_ino->i_direct[bucket];
+
+	if (bucket >= VSFS_NUM_DIRECT) {
+		if (root_ino->i_indirect == VSFS_BLK_UNASSIGNED) {
+			uint32_t indirect_index;
+			if (bitmap_alloc(dbmap, sb->sb_num_blocks, &indirect_index) != 0) {
+				return false;
+			}
+			sb->sb_free_blocks -= 1;
+			root_ino->i_indirect = indirect_index;
+			memset(image + (size_t)indirect_index * VSFS_BLOCK_SIZE, 0, VSFS_BLOCK_SIZE);
+		}
+		vsfs_blk_t *indirect = (vsfs_blk_t *)(image + (size_t)root_ino->i_indirect * VSFS_BLOCK_SIZE);
+		blk = &indirect[bucket - VSFS_NUM_DIRECT];
+	}
+
+	if (*blk == VSFS_BLK_UNASSIGNED) {
+		uint32_t db_index;
+		if (bitmap_alloc(dbmap, sb->sb_num_blocks, &db_index) != 0) {
+			return false;
+		}
+		sb->sb_free_blocks -= 1;
+		*blk = db_index;
+		root_ino->i_blocks += 1;
+
+		vsfs_dentry *entries = (vsfs_dentry *)(image + (size_t)db_index * VSFS_BLOCK_SIZE);
+		memset(entries, 0, VSFS_BLOCK_SIZE);
+		for (uint32_t i = 0; i < VSFS_BLOCK_SIZE / sizeof(vsfs_dentry); ++i) {
+			entries[i].ino = VSFS_INO_MAX;
+		}
+	}
+
+	// Only '.' and '..' are added, so the bucket cannot be full
+	vsfs_dentry *entries = (vsfs_dentry *)(image + (size_t)*blk * VSFS_BLOCK_SIZE);
+	uint32_t i = 0;
+	while (entries[i].ino != VSFS_INO_MAX) {
+		++i;
+	}
+	entries[i].ino = VSFS_ROOT_INO;
+	strcpy(entries[i].name, name);
+	return true;
+}
+
+
 /**
  * Format the image into vsfs.
  *
@@ -136,17 +237,60 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	vsfs_inode  *root_ino;     // ptr to root inode (in inode table)
 	vsfs_dentry *root_entries; // ptr to root dir data block in mmap'd image
 	
+	if (size / VSFS_BLOCK_SIZE > UINT32_MAX) {
+		return false;
+	}
 	vsfs_blk_t nblks = size / VSFS_BLOCK_SIZE;
-	sb->sb_num_blocks = nblks;
-	sb->sb_free_blocks = nblks;
-	uint32_t   inodes_per_block = VSFS_BLOCK_SIZE / sizeof(vsfs_inode);
+	size_t     inode_size = opts->inode_size != 0 ? opts->inode_size : sizeof(vsfs_inode);
+	uint32_t   inodes_per_block = VSFS_BLOCK_SIZE / inode_size;
+	uint32_t   bits_per_block = VSFS_BLOCK_SIZE * CHAR_BIT;
 	bool       ret = false;
 	
-	if (opts->n_inodes >= VSFS_INO_MAX) {
+	if (opts->n_inodes > UINT32_MAX - inodes_per_block) {
 		return false;
 	}
 
-	if (nblks > VSFS_BLK_MAX || nblks < VSFS_BLK_MIN) {
+	if (nblks < VSFS_BLK_MIN) {
+		return false;
+	}
+
+	// With block groups, each group of bits_per_block blocks gets an equal
+	// share of the inodes (in whole inode table blocks). A trailing group
+	// too small to hold any data past its inode table slice is left out.
+	uint32_t num_groups = 0;
+	uint64_t inodes_per_group = 0;
+	uint32_t num_inode_table_blocks; // of group 0, with block groups
+	if (opts->block_groups) {
+		num_groups = div_round_up(nblks, bits_per_block);
+		inodes_per_group = inodes_per_block *
+			(uint64_t)div_round_up(div_round_up(opts->n_inodes, num_groups), inodes_per_block);
+		if (num_groups > 1 &&
+		    nblks - (num_groups - 1) * bits_per_block <= inodes_per_group / inodes_per_block) {
+			num_groups -= 1;
+			nblks = num_groups * bits_per_block;
+			inodes_per_group = inodes_per_block *
+				(uint64_t)div_round_up(div_round_up(opts->n_inodes, num_groups), inodes_per_block);
+		}
+		if (inodes_per_group * num_groups > UINT32_MAX) {
+			return false;
+		}
+		num_inode_table_blocks = inodes_per_group / inodes_per_block;
+		sb->sb_num_inodes = inodes_per_group * num_groups;
+	} else {
+		num_inode_table_blocks = div_round_up(opts->n_inodes, inodes_per_block);
+		sb->sb_num_inodes = inodes_per_block * num_inode_table_blocks;
+	}
+	sb->sb_num_blocks = nblks;
+	sb->sb_free_blocks = nblks;
+
+	// Images that need more than one block for either bitmap get as many
+	// bitmap blocks as they need, and describe the layout in the superblock.
+	bool multi_bitmap = opts->block_groups || opts->n_inodes >= VSFS_INO_MAX || nblks > VSFS_BLK_MAX;
+	sb->sb_imap_blocks = div_round_up(sb->sb_num_inodes, bits_per_block);
+	sb->sb_dmap_blocks = div_round_up(nblks, bits_per_block);
+	uint64_t num_metadata_blocks = VSFS_IMAP_BLKNUM + (uint64_t)sb->sb_imap_blocks +
+	                               sb->sb_dmap_blocks + num_inode_table_blocks;
+	if (num_metadata_blocks >= nblks || (opts->block_groups && num_metadata_blocks >= bits_per_block)) {
 		return false;
 	}
 
@@ -155,36 +299,48 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	// for the given number of inodes in the file system.
 	
 	ibmap = (bitmap_t *)(image + VSFS_IMAP_BLKNUM * VSFS_BLOCK_SIZE);	
-	memset(ibmap, 0xff, VSFS_BLOCK_SIZE);
-	bitmap_init(ibmap, opts->n_inodes);
+	memset(ibmap, 0xff, (size_t)sb->sb_imap_blocks * VSFS_BLOCK_SIZE);
+	bitmap_init(ibmap, sb->sb_num_inodes);
+	sb->sb_free_inodes = sb->sb_num_inodes;
+
+	// VSFS_INO_MAX marks unused directory entries, so it can't be a file
+	if (sb->sb_num_inodes > VSFS_INO_MAX) {
+		bitmap_set(ibmap, sb->sb_num_inodes, VSFS_INO_MAX, true);
+		sb->sb_free_inodes -= 1;
+	}
 	
 	// Initialize data bitmap in memory (write to disk happens at munmap).
 	// First set all bits to 1, then use bitmap_init to clear the bits
 	// for the given number of blocks in the file system.
 	
-	dbmap = (bitmap_t *)(image + VSFS_DMAP_BLKNUM * VSFS_BLOCK_SIZE);
-	memset(dbmap, 0xff, VSFS_BLOCK_SIZE);
+	dbmap = (bitmap_t *)(image + (size_t)(VSFS_IMAP_BLKNUM + sb->sb_imap_blocks) * VSFS_BLOCK_SIZE);
+	memset(dbmap, 0xff, (size_t)sb->sb_dmap_blocks * VSFS_BLOCK_SIZE);
 	bitmap_init(dbmap, nblks);
 
-	// Mark first 3 blocks (superblock, inode bitmap, data bitmap) allocated.
-	bitmap_set(dbmap, nblks, VSFS_SB_BLKNUM, true); // superblock
-	bitmap_set(dbmap, nblks, VSFS_IMAP_BLKNUM, true); // inode bitmap block
-	bitmap_set(dbmap, nblks, VSFS_DMAP_BLKNUM, true); // data bitmap block
-	sb->sb_free_blocks -= 3;
+	// Mark the superblock and the inode and data bitmap blocks allocated.
+	for (vsfs_blk_t n = VSFS_SB_BLKNUM; n < VSFS_IMAP_BLKNUM + sb->sb_imap_blocks + sb->sb_dmap_blocks; ++n) {
+		bitmap_set(dbmap, nblks, n, true);
+		sb->sb_free_blocks -= 1;
+	}
 	
 	// Calculate size of inode table and mark inode table blocks allocated.
-	uint32_t num_inode_table_blocks = div_round_up(opts->n_inodes, inodes_per_block);
-	sb->sb_num_inodes = inodes_per_block * num_inode_table_blocks;
-	sb->sb_free_inodes = sb->sb_num_inodes;
+	// Only the blocks before it are in use, so it is a single run.
 	uint32_t first_itable_block_index;
-	int err = bitmap_alloc(dbmap, nblks, &first_itable_block_index);
-	assert(!err);
-	for (uint32_t n = first_itable_block_index; n < num_inode_table_blocks + first_itable_block_index; ++n) {
-		bitmap_set(dbmap, nblks, n, true);
-	}
+	uint32_t itable_blocks_got;
+	int err = bitmap_alloc_range(dbmap, nblks, 0, num_inode_table_blocks,
+	                             &first_itable_block_index, &itable_blocks_got);
+	assert(!err && itable_blocks_got == num_inode_table_blocks);
 	sb->sb_free_blocks -= num_inode_table_blocks;
 	sb->sb_data_region = first_itable_block_index + num_inode_table_blocks;
 
+	// The other block groups start with their inode table slices.
+	for (uint32_t group = 1; group < num_groups; ++group) {
+		for (uint32_t n = 0; n < num_inode_table_blocks; ++n) {
+			bitmap_set(dbmap, nblks, group * bits_per_block + n, true);
+		}
+		sb->sb_free_blocks -= num_inode_table_blocks;
+	}
+
 	// Initialize the root directory.
 	// 1. Mark root directory inode allocated in inode bitmap
 	uint32_t next_ibm_index;
@@ -193,39 +349,81 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	sb->sb_free_inodes -= 1;
 
 	// 2. Initialize fields of root dir inode (the mtime is done for you)
-	itable = (vsfs_inode *)(image + VSFS_ITBL_BLKNUM * VSFS_BLOCK_SIZE);	
-	root_ino = &itable[VSFS_ROOT_INO];
+	itable = (vsfs_inode *)(image + (size_t)first_itable_block_index * VSFS_BLOCK_SIZE);
+	root_ino = (vsfs_inode *)((char *)itable + VSFS_ROOT_INO * inode_size);
 	root_ino->i_mode = S_IFDIR | 0777;
 	root_ino->i_nlink = 2;
-	root_ino->i_blocks = 1;
-	root_ino->i_size = root_ino->i_blocks * VSFS_BLOCK_SIZE;
+	root_ino->i_blocks = 0;
+	root_ino->i_num_extents = 0;
 	memset(root_ino->i_direct, VSFS_BLK_UNASSIGNED,  VSFS_NUM_DIRECT * sizeof(vsfs_blk_t));
+	root_ino->i_indirect = VSFS_BLK_UNASSIGNED;
 	if (clock_gettime(CLOCK_REALTIME, &(root_ino->i_mtime)) != 0) {
 		perror("clock_gettime");
 		goto out;
 	}
-	
-	// 3. Allocate a data block for root directory; record it in root inode
-	uint32_t root_db_index;
-	err = bitmap_alloc(dbmap, nblks, &root_db_index);
-	assert(!err);
-	root_ino->i_direct[0] = root_db_index;
-	sb->sb_free_blocks -= 1;
-	
-	// 4. Create '.' and '..' entries in root dir data block.
-	root_entries = (vsfs_dentry *)(image + root_db_index * VSFS_BLOCK_SIZE);
-	root_entries[0].ino = VSFS_ROOT_INO;
-	strcpy(root_entries[0].name, ".");
 
-	root_entries[1].ino = VSFS_ROOT_INO;
-	strcpy(root_entries[1].name, "..");	
-	
-	// 5. Initialize other dir entries in block to invalid / unused state
-	//    Since 0 is a valid inode, use VSFS_INO_MAX to indicate invalid.
-	for (uint32_t i = 2; i < div_round_up(VSFS_BLOCK_SIZE, sizeof(vsfs_dentry)); ++i) {
-		root_entries[i].ino = VSFS_INO_MAX;
+	if (opts->hashed_dir) {
+		// 3-5. Put '.' and '..' into the blocks of their hash buckets
+		if (!add_hashed_root_entry(image, sb, dbmap, root_ino, ".") ||
+		    !add_hashed_root_entry(image, sb, dbmap, root_ino, "..")) {
+			goto out;
+		}
+		root_ino->i_size = root_ino->i_blocks * VSFS_BLOCK_SIZE;
+		sb->sb_flags = VSFS_SB_HASHED_DIR;
+	} else {
+		// 3. Allocate a data block for root directory; record it in root inode
+		uint32_t root_db_index;
+		err = bitmap_alloc(dbmap, nblks, &root_db_index);
+		assert(!err);
+		root_ino->i_direct[0] = root_db_index;
+		root_ino->i_blocks = 1;
+		root_ino->i_size = root_ino->i_blocks * VSFS_BLOCK_SIZE;
+		sb->sb_free_blocks -= 1;
+
+		// 4-5. Create '.' and '..' entries in root dir data block, and
+		//      initialize the rest of the block to unused.
+		if (opts->var_len_dir) {
+			// The last record always extends to the end of the block
+			void *root_block = image + (size_t)root_db_index * VSFS_BLOCK_SIZE;
+			dentry_var_init_block(root_block);
+			dentry_var_add(root_block, 0, VSFS_ROOT_INO, ".");
+			dentry_var_add(root_block, 0, VSFS_ROOT_INO, "..");
+			sb->sb_flags = VSFS_SB_VARLEN_DIR;
+		} else {
+			root_entries = (vsfs_dentry *)(image + (size_t)root_db_index * VSFS_BLOCK_SIZE);
+			root_entries[0].ino = VSFS_ROOT_INO;
+			strcpy(root_entries[0].name, ".");
+
+			root_entries[1].ino = VSFS_ROOT_INO;
+			strcpy(root_entries[1].name, "..");	
+
+			// Since 0 is a valid inode, use VSFS_INO_MAX to indicate invalid.
+			for (uint32_t i = 2; i < div_round_up(VSFS_BLOCK_SIZE, sizeof(vsfs_dentry)); ++i) {
+				root_entries[i].ino = VSFS_INO_MAX;
+			}
+			sb->sb_flags = 0;
+		}
 	}
 	
+	if (multi_bitmap) {
+		sb->sb_flags |= VSFS_SB_MULTI_BITMAP;
+	}
+	sb->sb_blocks_per_group = 0;
+	sb->sb_inodes_per_group = 0;
+	if (opts->block_groups) {
+		sb->sb_flags |= VSFS_SB_BLOCK_GROUPS;
+		sb->sb_blocks_per_group = bits_per_block;
+		sb->sb_inodes_per_group = inodes_per_group;
+	}
+	if (opts->extents) {
+		sb->sb_flags |= VSFS_SB_EXTENTS;
+	}
+	sb->sb_inode_size = 0;
+	if (opts->inode_size != 0) {
+		sb->sb_flags |= VSFS_SB_INLINE_DATA;
+		sb->sb_inode_size = inode_size;
+	}
+
 	// Initialize fields of superblock after everything else succeeds.
 	// Set start of data region to first block after inode table.
 	sb->sb_magic = VSFS_MAGIC;
@@ -257,7 +455,7 @@ int main(int argc, char *argv[])
 	}
 
 	// Map disk image file into memory
-	image = map_file(opts.img_path, VSFS_BLOCK_SIZE, &fsize);
+	image = map_file(opts.img_path, VSFS_BLOCK_SIZE, &fsize, NULL);
 	if (image == NULL) {
 		return 1;
 	}
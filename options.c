@@ -28,9 +28,19 @@
 
 #define VSFS_OPT(t, p) { t, offsetof(vsfs_opts, p), 1 }
 
+/**
+ * Default number of seconds the kernel may cache failed lookups. Every file
+ * is created through this mount, so a cached miss is invalidated by the kernel
+ * itself when the name is created and there is no risk of hiding a new file.
+ */
+#define VSFS_DEFAULT_NEGATIVE_TIMEOUT 1.0
+
 static const struct fuse_opt opt_spec[] = {
 	VSFS_OPT("-h"    , help),
 	VSFS_OPT("--help", help),
+	VSFS_OPT("negative_timeout=%lf", negative_timeout),
+	VSFS_OPT("lowlevel", lowlevel),
+	VSFS_OPT("fragstats", fragstats),
 	FUSE_OPT_END
 };
 
@@ -44,6 +54,12 @@ general options:\n\
     -o opt,[opt...]        mount options\n\
     -h   --help            print help\n\
 \n\
+vsfs options:\n\
+    -o negative_timeout=T  cache failed lookups for T seconds (default: %g)\n\
+    -o lowlevel            use the FUSE low-level (inode-based) API\n\
+    -o fragstats           print file and free space fragmentation statistics\n\
+                           when mounting and unmounting\n\
+\n\
 ";
 
 // Callback for fuse_opt_parse()
@@ -62,11 +78,12 @@ static int opt_proc(void *data, const char *arg, int key, struct fuse_args *out)
 
 bool vsfs_opt_parse(struct fuse_args *args, vsfs_opts *opts)
 {
+	opts->negative_timeout = VSFS_DEFAULT_NEGATIVE_TIMEOUT;
 	if (fuse_opt_parse(args, opts, opt_spec, opt_proc) != 0) return false;
 
 	//NOTE: printing to stderr to keep it consistent with FUSE
 	if (opts->help) {
-		fprintf(stderr, help_str, args->argv[0]);
+		fprintf(stderr, help_str, args->argv[0], VSFS_DEFAULT_NEGATIVE_TIMEOUT);
 		fuse_opt_add_arg(args, "-ho");
 	}
 	if (!opts->help && !opts->img_path) {
@@ -76,14 +93,37 @@ bool vsfs_opt_parse(struct fuse_args *args, vsfs_opts *opts)
 
 	// Only single-threaded mount is supported
 	fuse_opt_add_arg(args, "-s");
-	// Limit the size of reads and writes to 4K
+	// Let reads and writes span many blocks (up to 1M, or as much as the
+	// kernel sends in one request)
+	fuse_opt_add_arg(args, "-o");
+	fuse_opt_add_arg(args, "max_read=1048576");
+	fuse_opt_add_arg(args, "-o");
+	fuse_opt_add_arg(args, "big_writes");
 	fuse_opt_add_arg(args, "-o");
-	fuse_opt_add_arg(args, "max_read=4096");
+	fuse_opt_add_arg(args, "max_write=1048576");
+	// Let replies be spliced from the image file, and written data be spliced
+	// into it (see vsfs_read_buf() and vsfs_write_buf())
 	fuse_opt_add_arg(args, "-o");
-	fuse_opt_add_arg(args, "max_write=4096");
+	fuse_opt_add_arg(args, "splice_write");
+	fuse_opt_add_arg(args, "-o");
+	fuse_opt_add_arg(args, "splice_read");
+
+	// The remaining options belong to the high-level FUSE library. The
+	// low-level front end always uses vsfs inode numbers and applies the
+	// negative timeout in its own lookup replies.
+	if (opts->lowlevel && !opts->help) {
+		return true;
+	}
+
 	// Use vsfs inode numbers
 	fuse_opt_add_arg(args, "-o");
 	fuse_opt_add_arg(args, "use_ino");
+	// Let the kernel answer repeated lookups of missing names by itself
+	char negative_timeout_opt[64];
+	snprintf(negative_timeout_opt, sizeof(negative_timeout_opt),
+	         "negative_timeout=%g", opts->negative_timeout);
+	fuse_opt_add_arg(args, "-o");
+	fuse_opt_add_arg(args, negative_timeout_opt);
 	
 	return true;
 }
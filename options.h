@@ -29,6 +29,12 @@ typedef struct vsfs_opts {
 	const char *img_path;
 	/** Print help and exit. FUSE option. */
 	int help;
+	/** Seconds the kernel may cache failed lookups. FUSE option. */
+	double negative_timeout;
+	/** Serve requests through the FUSE low-level (inode-based) API. */
+	int lowlevel;
+	/** Print fragmentation statistics when mounting and unmounting. */
+	int fragstats;
 
 } vsfs_opts;
 
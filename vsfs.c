@@ -17,6 +17,7 @@
  */
 
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,6 +34,7 @@
 #include "bitmap.h"
 #include "map.h"
 #include "helper_functions.h"
+#include "vsfs_ll.h"
 
 //NOTE: All path arguments are absolute paths within the vsfs file system and
 // start with a '/' that corresponds to the vsfs root directory.
@@ -46,6 +48,31 @@
 // FUSE callbacks as "/dir".
 
 
+/** Get file system context. */
+static fs_ctx *get_fs(void)
+{
+	return (fs_ctx*)fuse_get_context()->private_data;
+}
+
+/** Get the state of an open file (see vsfs_open()). */
+static open_file *get_file(struct fuse_file_info *fi)
+{
+	return (open_file *)(uintptr_t)fi->fh;
+}
+
+/** Print the fragmentation statistics of the file system (see fill_frag_stats()). */
+static void print_frag_stats(fs_ctx *fs, const char *when)
+{
+	frag_stats st;
+	fill_frag_stats(fs, &st);
+	fprintf(stderr, "vsfs: fragmentation at %s: %u files, %" PRIu64 " blocks in %" PRIu64
+	        " extents (%.2f blocks per extent), %u fragmented files; "
+	        "%u free extents, largest %u blocks\n",
+	        when, st.files, st.blocks, st.extents,
+	        (st.extents == 0) ? 0.0 : (double)st.blocks / st.extents, st.fragmented_files,
+	        st.free_extents, st.largest_free_extent);
+}
+
 /**
  * Initialize the file system.
  *
@@ -61,19 +88,29 @@ static bool vsfs_init(fs_ctx *fs, vsfs_opts *opts)
 {
 	size_t size;
 	void *image;
+	int fd;
 	
 	// Nothing to initialize if only printing help
 	if (opts->help) {
 		return true;
 	}
 
-	// Map the disk image file into memory
-	image = map_file(opts->img_path, VSFS_BLOCK_SIZE, &size);
+	// Map the disk image file into memory, keeping it open for zero-copy I/O
+	image = map_file(opts->img_path, VSFS_BLOCK_SIZE, &size, &fd);
 	if (image == NULL) {
 		return false;
 	}
 
-	return fs_ctx_init(fs, image, size);
+	if (!fs_ctx_init(fs, image, size)) {
+		close(fd);
+		return false;
+	}
+	fs->image_fd = fd;
+	fs->frag_stats = opts->fragstats;
+	if (fs->frag_stats) {
+		print_frag_stats(fs, "mount");
+	}
+	return true;
 }
 
 /**
@@ -86,7 +123,13 @@ static void vsfs_destroy(void *ctx)
 {
 	fs_ctx *fs = (fs_ctx*)ctx;
 	if (fs->image) {
+		// Files that are still open give back the blocks reserved ahead of them
+		trim_all_preallocs(fs);
+		if (fs->frag_stats) {
+			print_frag_stats(fs, "unmount");
+		}
 		munmap(fs->image, fs->size);
+		close(fs->image_fd);
 		fs_ctx_destroy(fs);
 	}
 }
@@ -98,6 +141,8 @@ static void vsfs_destroy(void *ctx)
  *   - An element on the path cannot be found
  */
 static int path_lookup(const char *path, vsfs_ino_t *ino) {
+	fs_ctx *fs = get_fs();
+
 	if(path[0] != '/') {
 		fprintf(stderr, "Not an absolute path\n");
 		return -ENOSYS;
@@ -108,26 +153,14 @@ static int path_lookup(const char *path, vsfs_ino_t *ino) {
 		*ino = VSFS_ROOT_INO;
 		return 0;
 	}
-	fs_ctx *fs = get_fs();
-	vsfs_inode *itable = fs->itable;
-	vsfs_inode *root_inode = &itable[VSFS_ROOT_INO];
-	const char *path_name = path + 1;
-
-	uint32_t valid_direct_found = get_path_inode(VSFS_NUM_DIRECT, root_inode->i_direct, path_name, ino);
-	if (*ino != VSFS_INO_MAX) {
-		return 0;
-	}
-
-	if (root_inode->i_indirect != VSFS_BLK_UNASSIGNED) {
-		uint32_t num_indirect_blocks = root_inode->i_blocks - valid_direct_found;
-		vsfs_blk_t *indirect_block_number = (vsfs_blk_t *)(fs->image + root_inode->i_indirect * VSFS_BLOCK_SIZE);
-		get_path_inode(num_indirect_blocks, indirect_block_number, path_name, ino);
-		if (*ino != VSFS_INO_MAX) {
-			return 0;
-		}
+	// Only the root directory exists, so the rest of the path is the name
+	// of an entry in the root directory
+	dir_index_entry path_entry;
+	if (!root_dir_lookup(fs, path + 1, &path_entry)) {
+		return -1;
 	}
-
-	return -1;
+	*ino = path_entry.ino;
+	return 0;
 }
 
 /**
@@ -149,22 +182,8 @@ static int vsfs_statfs(const char *path, struct statvfs *st)
 {
 	(void)path;// unused
 	fs_ctx *fs = get_fs();
-	vsfs_superblock *sb = fs->sb; /* Get ptr to superblock from context */
-	
-	memset(st, 0, sizeof(*st));
-	st->f_bsize   = VSFS_BLOCK_SIZE;   /* Filesystem block size */
-	st->f_frsize  = VSFS_BLOCK_SIZE;   /* Fragment size */
-	// The rest of required fields are filled based on the information 
-	// stored in the superblock.
-        st->f_blocks = sb->sb_num_blocks;     /* Size of fs in f_frsize units */
-        st->f_bfree  = sb->sb_free_blocks;    /* Number of free blocks */
-        st->f_bavail = sb->sb_free_blocks;    /* Free blocks for unpriv users */
-		st->f_files  = sb->sb_num_inodes;     /* Number of inodes */
-        st->f_ffree  = sb->sb_free_inodes;    /* Number of free inodes */
-        st->f_favail = sb->sb_free_inodes;    /* Free inodes for unpriv users */
-
-	st->f_namemax = VSFS_NAME_MAX;     /* Maximum filename length */
 
+	fill_statvfs(fs, st);
 	return 0;
 }
 
@@ -196,77 +215,47 @@ static int vsfs_getattr(const char *path, struct stat *st)
 	if (strlen(path) >= VSFS_PATH_MAX) return -ENAMETOOLONG;
 	fs_ctx *fs = get_fs();
 
-	memset(st, 0, sizeof(*st));
-
 	// Lookup the inode for given path and, if it exists, fill in the
 	// required fields based on the information stored in the inode
 	vsfs_ino_t inode_index_for_given_path;
-	vsfs_inode *itable = fs->itable;
-	if (path_lookup(path, &inode_index_for_given_path) == 0) {
-		vsfs_inode *inode_for_given_path = &itable[inode_index_for_given_path];
-		st->st_ino = inode_index_for_given_path;
-		st->st_mode = inode_for_given_path->i_mode;
-		st->st_nlink = inode_for_given_path->i_nlink;
-		st->st_size = inode_for_given_path->i_size;
-		st->st_blocks = (inode_for_given_path->i_blocks * VSFS_BLOCK_SIZE) / 512;
-		if (inode_for_given_path->i_indirect != VSFS_BLK_UNASSIGNED) {
-			st->st_blocks += VSFS_BLOCK_SIZE / 512;
-		}
-		st->st_mtim = inode_for_given_path->i_mtime;
-		return 0;
-	} 
-	else {
+	if (path_lookup(path, &inode_index_for_given_path) != 0) {
 		return -ENOENT;
 	}
-	return -ENOSYS;
+	fill_inode_stat(fs, inode_index_for_given_path, st);
+	return 0;
 }
 
 /**
  * Read a directory.
  *
- * Implements the readdir() system call. Should call filler(buf, name, NULL, 0)
- * for each directory entry. See fuse.h in libfuse source code for details.
+ * Implements the readdir() system call. Calls filler(buf, name, st, off)
+ * for each directory entry, where off is the offset to resume from after that
+ * entry. See fuse.h in libfuse source code for details.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a directory.
  *
- * Errors:
- *   ENOMEM  not enough memory (e.g. a filler() call failed).
+ * A large directory is listed over several calls: once the buffer is full
+ * (filler() returns nonzero), the remaining entries are left for the next
+ * call, which passes the offset of the last entry that was added.
  *
  * @param path    path to the directory.
  * @param buf     buffer that receives the result.
  * @param filler  function that needs to be called for each directory entry.
- *                Pass 0 as offset (4th argument). 3rd argument can be NULL.
- * @param offset  unused.
+ *                3rd argument receives the entry's attributes, as returned
+ *                by getattr().
+ * @param offset  offset to resume from; 0 for the first entry.
  * @param fi      unused.
  * @return        0 on success; -errno on error.
  */
 static int vsfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                         off_t offset, struct fuse_file_info *fi)
 {
-	(void)offset;// unused
 	(void)fi;// unused
 	fs_ctx *fs = get_fs();
 
 	assert(strcmp(path, "/") == 0);
-	vsfs_inode *itable = fs->itable;
-	vsfs_inode *root_inode = &itable[VSFS_ROOT_INO];
-
-	int valid_direct_found = read_directory_entries(VSFS_NUM_DIRECT, root_inode->i_direct, buf, filler);
-	if (valid_direct_found == -ENOBUFS) {
-		return -ENOMEM;
-	}
-
-	if (root_inode->i_indirect != VSFS_BLK_UNASSIGNED) {
-		uint32_t num_indirect_blocks = root_inode->i_blocks - valid_direct_found;
-		vsfs_blk_t *indirect_block_number = (vsfs_blk_t *)(fs->image + root_inode->i_indirect * VSFS_BLOCK_SIZE);
-		int valid_indirect_found = read_directory_entries(num_indirect_blocks, indirect_block_number, buf, filler);
-		if (valid_indirect_found == -ENOBUFS) {
-			return -ENOMEM;
-		}
-	}
-	
-	return 0;
+	return read_directory_entries(fs, offset, buf, filler);
 }
 
 /**
@@ -285,97 +274,74 @@ static int vsfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
  *
  * @param path  path to the file to create.
  * @param mode  file mode bits.
- * @param fi    unused.
+ * @param fi    file info; fi->fh receives the state of the new open file.
  * @return      0 on success; -errno on error.
  */
 static int vsfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-	(void)fi;// unused
 	assert(S_ISREG(mode));
 	fs_ctx *fs = get_fs();
-	vsfs_superblock *superblock = fs->sb;
-
-	// Create a file at the given path with the given mode
-	(void)path;
-	(void)mode;
-
-	// Check if there is space in the file system for a new file
-	if (superblock->sb_free_inodes == 0 || superblock->sb_free_blocks == 0) {
-		return -ENOSPC;
-	}
 
-	// First allocate space in the inode bitmap for the new file
-	bitmap_t *inode_bitmap = fs->ibmap;
-	uint32_t next_inode_bitmap_index;
-	allocate_bitmap_index(inode_bitmap, superblock->sb_num_inodes, &next_inode_bitmap_index);
-	superblock->sb_free_inodes -= 1;
-
-	// Now create and initialize the fields of the new file as a vsfs_inode
-	vsfs_inode *itable = fs->itable;
-	vsfs_inode *new_file_inode = &itable[next_inode_bitmap_index];
-	new_file_inode->i_mode = mode;
-	new_file_inode->i_nlink = 1;
-	new_file_inode->i_blocks = 0;
-	new_file_inode->i_size = 0;
-	memset(new_file_inode->i_direct, VSFS_BLK_UNASSIGNED, VSFS_NUM_DIRECT * sizeof(vsfs_blk_t));
-	if (clock_gettime(CLOCK_REALTIME, &(new_file_inode->i_mtime)) != 0) {
-		perror("clock_gettime");
-		return -ENOSYS;
+	open_file *file = open_file_new(VSFS_INO_MAX);
+	if (file == NULL) {
+		return -ENOMEM;
 	}
-
-	// Next, get the root inode's values
-	vsfs_inode *root_inode = &itable[VSFS_ROOT_INO];
-	const char *path_name = path + 1;
-
-	// Now, check if the root_inode->i_direct array has any space for new directory entries
-	// use bitmap_alloc on the data bitmap to check for this instead of what im currently doing
-	uint32_t direct_array_index;
-	uint32_t index_within_direct_array;
-	uint32_t valid_direct_found = next_available_dentry(VSFS_NUM_DIRECT, root_inode->i_direct, &direct_array_index, &index_within_direct_array);
-	if (valid_direct_found < VSFS_NUM_DIRECT) {
-		// If next_available_dentry was unable to find any space in the currently allocated direct blocks,
-		// and there is space for more direct blocks, then we allocate a new direct block and initialize
-		// the first directory entry value in this block to be the new file
-		if (direct_array_index == VSFS_BLK_UNASSIGNED && index_within_direct_array == VSFS_INO_MAX) {
-			return allocate_block(superblock->sb_num_blocks, root_inode->i_direct, new_file_inode, next_inode_bitmap_index, path_name);
-		}
-		// If there is space available in the currently allocated direct blocks, then we will simply
-		// add this new file to the tail of the directory entries
-		else {
-			vsfs_dentry *add_to_direct_array = (vsfs_dentry *)(fs->image + root_inode->i_direct[direct_array_index] * VSFS_BLOCK_SIZE);
-			return add_entry_to_block(add_to_direct_array, index_within_direct_array, new_file_inode, next_inode_bitmap_index, path_name);
-		}
+	int err = create_file(fs, path + 1, mode, &file->ino);
+	if (err != 0) {
+		free(file);
+		return err;
 	}
+	fi->fh = (uintptr_t)file;
+	return 0;
+}
 
-	// If all of the direct blocks are full and the indirect block doesn't exist,
-	// we will need to allocate the indirect block and put the new file's entry there
-	if (valid_direct_found == VSFS_NUM_DIRECT && root_inode->i_indirect == VSFS_BLK_UNASSIGNED) {
-		return allocate_first_indirect_block(new_file_inode, next_inode_bitmap_index, path_name);
-	}
+/**
+ * Open a file.
+ *
+ * Implements the open() system call. The inode number of the file is kept in
+ * an open_file in fi->fh, so that read(), write() and ftruncate() on the open
+ * file go straight to the inode table instead of looking up the path again.
+ *
+ * Assumptions (already verified by FUSE using getattr() calls):
+ *   "path" exists and is a file.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *
+ * @param path  path to the file to open.
+ * @param fi    file info; fi->fh receives the state of the open file.
+ * @return      0 on success; -errno on error.
+ */
+static int vsfs_open(const char *path, struct fuse_file_info *fi)
+{
+	vsfs_ino_t ino;
+	int err = path_lookup(path, &ino);
+	assert(!err);
 
-	// Since we did not find any available space in the root inode's direct blocks
-	// and the indirect block exists, we will now check the indirect blocks for space
-	if (root_inode->i_indirect != VSFS_BLK_UNASSIGNED) {
-		uint32_t num_indirect_blocks = root_inode->i_blocks - valid_direct_found;
-		vsfs_blk_t *indirect_block_number = (vsfs_blk_t *)(fs->image + root_inode->i_indirect * VSFS_BLOCK_SIZE);
-		uint32_t indirect_array_index;
-		uint32_t index_within_indirect_array;
-		next_available_dentry(num_indirect_blocks, indirect_block_number, &indirect_array_index, &index_within_indirect_array);
-		// If next_available_dentry was unable to find any space in the currently allocated indirect
-		// blocks, then we allocate a new indirect block and initialize the first directory entry 
-		// value in this block to be the new file
-		if (indirect_array_index == VSFS_BLK_UNASSIGNED && index_within_indirect_array == VSFS_INO_MAX) {
-			return allocate_block(superblock->sb_num_blocks, indirect_block_number, new_file_inode, next_inode_bitmap_index, path_name);
-		}
-		// If there is space available in the currently allocated direct blocks, then we will simply
-		// add this new file to the tail of the directory entries
-		else {
-			vsfs_dentry *add_to_indirect_array = (vsfs_dentry *)(fs->image + indirect_block_number[indirect_array_index] * VSFS_BLOCK_SIZE);
-			return add_entry_to_block(add_to_indirect_array, index_within_indirect_array, new_file_inode, next_inode_bitmap_index, path_name);
-		}
+	open_file *file = open_file_new(ino);
+	if (file == NULL) {
+		return -ENOMEM;
 	}
+	fi->fh = (uintptr_t)file;
+	return 0;
+}
 
-	return -ENOSYS;
+/**
+ * Close a file.
+ *
+ * Called once the last file descriptor of an open file is closed. Frees the
+ * state allocated by vsfs_open() or vsfs_create(), and the block map cache
+ * of the file once no other open file uses it.
+ *
+ * @param path  unused.
+ * @param fi    file info of the open file.
+ * @return      0.
+ */
+static int vsfs_release(const char *path, struct fuse_file_info *fi)
+{
+	(void)path;// unused
+	open_file_free(get_fs(), get_file(fi));
+	return 0;
 }
 
 /**
@@ -397,50 +363,13 @@ static int vsfs_unlink(const char *path)
 
 	// Remove the file at given path
 
-	// First get the index of the input path from the inode table
-	vsfs_ino_t path_inode_index;
-	int err = path_lookup(path, &path_inode_index);
-	assert(!err);
-
-	// Create some global variables and get the inode for the input path
-	vsfs_inode *itable = fs->itable;
-	vsfs_inode *root_inode = &itable[VSFS_ROOT_INO];
-	vsfs_inode *path_file_inode = &itable[path_inode_index];
-	const char *path_name = path + 1;
-
-	// Check to see whether the inode for the input path is in the direct data block array
-	// of the root inode
-	uint32_t direct_array_index;
-	uint32_t index_within_direct_array;
-	uint32_t valid_direct_found = find_path_data_block(VSFS_NUM_DIRECT, root_inode->i_direct, path_name, &direct_array_index, &index_within_direct_array);
-	// If it is not in the direct data block array of the root inode, we must check the indirect
-	// data block array of the root inode if it exists
-	if (direct_array_index == VSFS_BLK_UNASSIGNED && index_within_direct_array == VSFS_INO_MAX) {
-		if (root_inode->i_indirect != VSFS_BLK_UNASSIGNED) {
-			uint32_t num_indirect_blocks = root_inode->i_blocks - valid_direct_found;
-			vsfs_blk_t *indirect_block_number = (vsfs_blk_t *)(fs->image + root_inode->i_indirect * VSFS_BLOCK_SIZE);
-			uint32_t indirect_array_index;
-			uint32_t index_within_indirect_array;
-			find_path_data_block(num_indirect_blocks, indirect_block_number, path_name, &indirect_array_index, &index_within_indirect_array);
-			
-			// If the inode for the input path is in the indirect data block array,
-			// then we can unlink it from the rest of the file system
-			if (indirect_array_index != VSFS_BLK_UNASSIGNED && index_within_indirect_array != VSFS_INO_MAX) {
-				vsfs_dentry *indirect_array = (vsfs_dentry *)(fs->image + indirect_block_number[indirect_array_index] * VSFS_BLOCK_SIZE);
-				vsfs_dentry *path_dentry = &indirect_array[index_within_indirect_array];
-				return unlink_entire_file(path_dentry, path_file_inode, indirect_array_index, path_inode_index);
-			}
-		}
-	}
-	else {
-		// If the inode for the input path is in the direct data block array of the root inode,
-		// we can unlink it from the rest of the file system
-		vsfs_dentry *direct_array = (vsfs_dentry *)(fs->image + root_inode->i_direct[direct_array_index] * VSFS_BLOCK_SIZE);
-		vsfs_dentry *path_dentry = &direct_array[index_within_direct_array];
-		return unlink_entire_file(path_dentry, path_file_inode, direct_array_index, path_inode_index);
-	}
+	// Find where the entry for the input path is stored, so we can unlink it
+	// without searching the directory again
+	dir_index_entry path_entry;
+	bool found = root_dir_lookup(fs, path + 1, &path_entry);
+	assert(found);
 
-	return -ENOSYS;
+	return unlink_entire_file(fs, &path_entry);
 }
 
 
@@ -477,23 +406,11 @@ static int vsfs_utimens(const char *path, const struct timespec times[2])
 	}
 
 	// 1. Find the inode for the final component in path
-	vsfs_inode *itable = fs->itable;
-	vsfs_inode *root_inode = &itable[VSFS_ROOT_INO];
-	const char *path_name = path + 1;
 	vsfs_ino_t inode_num;
-
-	uint32_t valid_direct_found = get_path_inode(VSFS_NUM_DIRECT, root_inode->i_direct, path_name, &inode_num);
-	if (inode_num == VSFS_INO_MAX) {
-		if (root_inode->i_indirect != VSFS_BLK_UNASSIGNED) {
-			uint32_t num_indirect_blocks = root_inode->i_blocks - valid_direct_found;
-			vsfs_blk_t *indirect_block_number = (vsfs_blk_t *)(fs->image + root_inode->i_indirect * VSFS_BLOCK_SIZE);
-			get_path_inode(num_indirect_blocks, indirect_block_number, path_name, &inode_num);
-			if (inode_num == VSFS_INO_MAX) {
-				return -1;
-			}
-		}
+	if (path_lookup(path, &inode_num) != 0) {
+		return -ENOENT;
 	}
-	ino = &itable[inode_num];
+	ino = fs_inode(fs, inode_num);
 	
 	// 2. Update the mtime for that inode.
 	//    This code is commented out to avoid failure until you have set
@@ -517,7 +434,8 @@ static int vsfs_utimens(const char *path, const struct timespec times[2])
  *
  * Implements the truncate() system call. Supports both extending and shrinking.
  * If the file is extended, the new uninitialized range at the end must be
- * filled with zeros.
+ * filled with zeros. vsfs leaves it as a hole that reads back as zeros; its
+ * blocks are only allocated once they are written to.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
@@ -539,140 +457,26 @@ static int vsfs_truncate(const char *path, off_t size)
 	int err = path_lookup(path, &path_inode_index);
 	assert(!err);
 
-	vsfs_superblock *superblock = fs->sb;
-	bitmap_t *data_bitmap = fs->dbmap;
-	vsfs_inode *itable = fs->itable;
-	vsfs_inode *path_file_inode = &itable[path_inode_index];
-
-	if (path_file_inode->i_blocks == div_round_up(size, VSFS_BLOCK_SIZE)) {
-		path_file_inode->i_size = size;
-		return 0;
-	}
+	return truncate_inode(fs, path_inode_index, size);
+}
 
-	if (path_file_inode->i_blocks < div_round_up(size, VSFS_BLOCK_SIZE)) {
-		if (superblock->sb_free_blocks < (div_round_up(size, VSFS_BLOCK_SIZE) - path_file_inode->i_blocks)) {
-			return -ENOSPC;
-		}
-		else {
-			uint32_t num_blocks_to_add = div_round_up(size, VSFS_BLOCK_SIZE) - path_file_inode->i_blocks;
-			uint32_t valid_direct_found = 0;
-			for (uint32_t direct_index = 0; direct_index < VSFS_NUM_DIRECT; ++direct_index) {
-				if (path_file_inode->i_direct[direct_index] != VSFS_BLK_UNASSIGNED) {
-					valid_direct_found += 1;
-				}
-			}
-
-			if (valid_direct_found < VSFS_NUM_DIRECT) {
-				uint32_t direct_to_add = num_blocks_to_add;
-				uint32_t direct_added = 0;
-				while (direct_added < direct_to_add) {
-					int err = allocate_empty_file_block(VSFS_NUM_DIRECT, path_file_inode->i_direct, path_file_inode);
-					if (!err) {
-						direct_added += 1;
-					}
-					else {
-						break;
-					}
-				}
-
-				if (direct_added < num_blocks_to_add) {
-					if (path_file_inode->i_indirect == VSFS_BLK_UNASSIGNED) {
-						uint32_t next_data_bitmap_index;
-						allocate_bitmap_index(data_bitmap, superblock->sb_num_blocks, &next_data_bitmap_index);
-						superblock->sb_free_blocks -= 1;
-
-						path_file_inode->i_indirect = next_data_bitmap_index;
-						vsfs_blk_t *indirect_block_number = (vsfs_blk_t *)(fs->image + path_file_inode->i_indirect * VSFS_BLOCK_SIZE);
-						memset(indirect_block_number, VSFS_BLK_UNASSIGNED, VSFS_BLOCK_SIZE);
-					}
-					uint32_t indirect_to_add = num_blocks_to_add - direct_added;
-					vsfs_blk_t *indirect_block_number = (vsfs_blk_t *)(fs->image + path_file_inode->i_indirect * VSFS_BLOCK_SIZE);
-					for (uint32_t indirect_added = 0; indirect_added < indirect_to_add; ++indirect_added) {
-						allocate_empty_file_block(fs->num_blk_per_b, indirect_block_number, path_file_inode);
-					}
-				}
-				if (clock_gettime(CLOCK_REALTIME, &(path_file_inode->i_mtime)) != 0) {
-					perror("clock_gettime");
-					return -ENOSYS;
-				}
-				path_file_inode->i_size = size;
-				return 0;
-			}
-			else {
-				if (path_file_inode->i_indirect != VSFS_BLK_UNASSIGNED) {
-					uint32_t indirect_to_add = num_blocks_to_add;
-					vsfs_blk_t *indirect_block_number = (vsfs_blk_t *)(fs->image + path_file_inode->i_indirect * VSFS_BLOCK_SIZE);
-					for (uint32_t indirect_added = 0; indirect_added < indirect_to_add; ++indirect_added) {
-						allocate_empty_file_block(fs->num_blk_per_b, indirect_block_number, path_file_inode);
-					}
-					if (clock_gettime(CLOCK_REALTIME, &(path_file_inode->i_mtime)) != 0) {
-						perror("clock_gettime");
-						return -ENOSYS;
-					}
-					path_file_inode += 1;
-					path_file_inode->i_size = size;
-					return 0;
-				}
-			}
-		}
-	}
-	else {
-		uint32_t num_blocks_to_remove = path_file_inode->i_blocks - div_round_up(size, VSFS_BLOCK_SIZE);
-		if (path_file_inode->i_indirect != VSFS_BLK_UNASSIGNED) {
-			vsfs_blk_t *indirect_block_number = (vsfs_blk_t *)(fs->image + path_file_inode->i_indirect * VSFS_BLOCK_SIZE);
-			uint32_t indirect_blocks_removed = remove_eof(fs->num_blk_per_b, num_blocks_to_remove, indirect_block_number, path_file_inode);
-
-			uint32_t valid_indirect_found = 0;
-			for (uint32_t indirect_index = 0; indirect_index < fs->num_blk_per_b; ++indirect_index) {
-				if (indirect_block_number[indirect_index] != VSFS_BLK_UNASSIGNED) {
-					valid_indirect_found += 1;
-				}
-			}
-
-			if (valid_indirect_found == 0) {
-				bitmap_free(data_bitmap, superblock->sb_num_blocks, path_file_inode->i_indirect);
-				path_file_inode->i_indirect = VSFS_BLK_UNASSIGNED;
-				superblock->sb_free_blocks += 1;
-			}
-
-			if (indirect_blocks_removed < num_blocks_to_remove) {
-				uint32_t direct_to_remove = num_blocks_to_remove - indirect_blocks_removed;
-				uint32_t direct_blocks_removed = remove_eof(VSFS_NUM_DIRECT, direct_to_remove, path_file_inode->i_direct, path_file_inode);
-				if (indirect_blocks_removed + direct_blocks_removed == num_blocks_to_remove) {
-					if (clock_gettime(CLOCK_REALTIME, &(path_file_inode->i_mtime)) != 0) {
-						perror("clock_gettime");
-						return -ENOSYS;
-					}
-					path_file_inode->i_size = size;
-					return 0;
-				}
-			}
-			else {
-				if (indirect_blocks_removed == num_blocks_to_remove) {
-					if (clock_gettime(CLOCK_REALTIME, &(path_file_inode->i_mtime)) != 0) {
-						perror("clock_gettime");
-						return -ENOSYS;
-					}
-					path_file_inode->i_size = size;
-					return 0;
-				}
-			}
-		}
-		else {
-			uint32_t direct_to_remove = num_blocks_to_remove;
-			uint32_t direct_blocks_removed = remove_eof(VSFS_NUM_DIRECT, direct_to_remove, path_file_inode->i_direct, path_file_inode);
-			if (direct_blocks_removed == num_blocks_to_remove) {
-				if (clock_gettime(CLOCK_REALTIME, &(path_file_inode->i_mtime)) != 0) {
-					perror("clock_gettime");
-					return -ENOSYS;
-				}
-				path_file_inode->i_size = size;
-				return 0;
-			}
-		}
-	}
+/**
+ * Change the size of an open file.
+ *
+ * Implements the ftruncate() system call. Same as vsfs_truncate(), except that
+ * the file is identified by the open file kept in fi->fh.
+ *
+ * @param path  unused.
+ * @param size  new file size in bytes.
+ * @param fi    file info of the open file.
+ * @return      0 on success; -errno on error.
+ */
+static int vsfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	(void)path;// unused
+	fs_ctx *fs = get_fs();
 
-	return -ENOSYS;
+	return truncate_inode(fs, get_file(fi)->ino, size);
 }
 
 /**
@@ -680,61 +484,56 @@ static int vsfs_truncate(const char *path, off_t size)
  *
  * Implements the pread() system call. Must return exactly the number of bytes
  * requested except on EOF (end of file). Reads from file ranges that have not
- * been written to must return ranges filled with zeros. You can assume that the
- * byte range from offset to offset + size is contained within a single block.
+ * been written to must return ranges filled with zeros. The byte range from
+ * offset to offset + size may span many blocks (see max_read in options.c).
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
  *
  * Errors: none
  *
- * @param path    path to the file to read from.
+ * @param path    unused.
  * @param buf     pointer to the buffer that receives the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to read from.
- * @param fi      unused.
+ * @param fi      file info of the open file.
  * @return        number of bytes read on success; 0 if offset is beyond EOF;
  *                -errno on error.
  */
 static int vsfs_read(const char *path, char *buf, size_t size, off_t offset,
                      struct fuse_file_info *fi)
 {
-	(void)fi;// unused
+	(void)path;// unused
 	fs_ctx *fs = get_fs();
 
-	// Read data from the file at given offset into the buffer
-
-	vsfs_ino_t path_inode_index;
-	int err = path_lookup(path, &path_inode_index);
-	assert(!err);
-
-	vsfs_inode *itable = fs->itable;
-	vsfs_inode *path_file_inode = &itable[path_inode_index];
-	uint32_t offset_block = div_round_up(offset, VSFS_BLOCK_SIZE);
-	size_t size_read = size;
-
-	if ((long int)path_file_inode->i_size < offset) {
-		return 0;
-	}
-
-	if (path_file_inode->i_size < offset + size) {
-		size_read = path_file_inode->i_size - offset;
-	}
+	return read_inode(fs, get_file(fi), buf, size, offset);
+}
 
-	if (offset_block < VSFS_NUM_DIRECT) {
-		char *read_portion = (char *)(fs->image + path_file_inode->i_direct[offset_block] * VSFS_BLOCK_SIZE + (offset % VSFS_BLOCK_SIZE));
-		memcpy(buf, read_portion, size_read);
-		return (int)size_read;
-	}
-	else {
-		vsfs_blk_t *indirect_block_number = (vsfs_blk_t *)(fs->image + path_file_inode->i_indirect * VSFS_BLOCK_SIZE);
-		offset_block -= VSFS_NUM_DIRECT;
-		char *read_portion = (char *)(fs->image + indirect_block_number[offset_block] * VSFS_BLOCK_SIZE + (offset % VSFS_BLOCK_SIZE));
-		memcpy(buf, read_portion, size_read);
-		return (int)size_read;
-	}
+/**
+ * Read data from a file without copying it.
+ *
+ * Takes the place of vsfs_read() when FUSE supports it. Instead of copying the
+ * data into a buffer, returns a buffer vector that refers to the blocks of the
+ * file by their offsets in the image file, so that FUSE can splice them
+ * straight into its reply (see read_inode_buf()). FUSE frees the vector.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *
+ * @param path    unused.
+ * @param bufp    pointer to the variable that receives the buffer vector.
+ * @param size    number of bytes requested.
+ * @param offset  offset from the beginning of the file to read from.
+ * @param fi      file info of the open file.
+ * @return        0 on success; -errno on error.
+ */
+static int vsfs_read_buf(const char *path, struct fuse_bufvec **bufp,
+                         size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	(void)path;// unused
+	fs_ctx *fs = get_fs();
 
-	return -ENOSYS;
+	return read_inode_buf(fs, get_file(fi), size, offset, bufp);
 }
 
 /**
@@ -743,8 +542,10 @@ static int vsfs_read(const char *path, char *buf, size_t size, off_t offset,
  * Implements the pwrite() system call. Must return exactly the number of bytes
  * requested except on error. If the offset is beyond EOF (end of file), the
  * file must be extended. If the write creates a "hole" of uninitialized data,
- * the new uninitialized range must filled with zeros. You can assume that the
- * byte range from offset to offset + size is contained within a single block.
+ * the new uninitialized range must filled with zeros (vsfs leaves it as a hole,
+ * see vsfs_truncate()). The byte range from offset to offset + size may span
+ * many blocks (see max_write in options.c); the blocks it needs are allocated
+ * together. If only some of them can be allocated, the write stops short.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
@@ -752,116 +553,71 @@ static int vsfs_read(const char *path, char *buf, size_t size, off_t offset,
  * Errors:
  *   ENOMEM  not enough memory (e.g. a malloc() call failed).
  *   ENOSPC  not enough free space in the file system.
- *   EFBIG   write would exceed the maximum file size 
+ *   EFBIG   write would exceed the maximum file size, or the file's extents
+ *           don't fit into an extent block
  *
- * @param path    path to the file to write to.
+ * @param path    unused.
  * @param buf     pointer to the buffer containing the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to write to.
- * @param fi      unused.
+ * @param fi      file info of the open file.
  * @return        number of bytes written on success; -errno on error.
  */
 static int vsfs_write(const char *path, const char *buf, size_t size,
                       off_t offset, struct fuse_file_info *fi)
 {
-	(void)fi;// unused
+	(void)path;// unused
 	fs_ctx *fs = get_fs();
 
-	// Write data from the buffer into the file at given offset, possibly
-	// "zeroing out" the uninitialized range
-	
-	vsfs_ino_t path_inode_index;
-	int err = path_lookup(path, &path_inode_index);
-	assert(!err);
-
-	vsfs_inode *itable = fs->itable;
-	vsfs_inode *root_inode = &itable[VSFS_ROOT_INO];
-	vsfs_inode *path_file_inode = &itable[path_inode_index];
-	uint32_t offset_block = div_round_up(offset, VSFS_BLOCK_SIZE);
-	size_t size_write = size;
-
-	if (path_file_inode->i_size < offset + size) {
-		off_t new_size = path_file_inode->i_size + offset + size;
-		int err = vsfs_truncate(path, new_size);
-		if (err != 0) {
-			return err;
-		}
-
-		if (offset_block < VSFS_NUM_DIRECT) {
-			vsfs_dentry *write_location = (vsfs_dentry *)(fs->image + path_file_inode->i_direct[offset_block] * VSFS_BLOCK_SIZE + (offset % VSFS_BLOCK_SIZE));
-			if (write_location->ino != VSFS_BLK_UNASSIGNED) {
-				memset(write_location, VSFS_BLK_UNASSIGNED, strlen(write_location->name)); // maybe do memset(write_location, VSFS_BLK_UNASSIGNED, strlen(write_location->name));
-			}
-			write_location->ino = path_inode_index;
-			memcpy(write_location, buf, size_write);
-			if (clock_gettime(CLOCK_REALTIME, &(path_file_inode->i_mtime)) != 0) {
-				perror("clock_gettime");
-				return -ENOSYS;
-			}
-			root_inode->i_mtime = path_file_inode->i_mtime;
-			return (int)size_write;
-		}
-		else {
-			vsfs_blk_t *indirect_block_number = (vsfs_blk_t *)(fs->image + path_file_inode->i_indirect * VSFS_BLOCK_SIZE + (offset % VSFS_BLOCK_SIZE));
-			offset_block -= VSFS_NUM_DIRECT;
-			vsfs_dentry *write_location = (vsfs_dentry *)(fs->image + indirect_block_number[offset_block] * VSFS_BLOCK_SIZE);
-			if (write_location->ino != VSFS_BLK_UNASSIGNED) {
-				memset(write_location, VSFS_BLK_UNASSIGNED, strlen(write_location->name));
-			}
-			memcpy(write_location, buf, size_write);
-			if (clock_gettime(CLOCK_REALTIME, &(path_file_inode->i_mtime)) != 0) {
-				perror("clock_gettime");
-				return -ENOSYS;
-			}
-			root_inode->i_mtime = path_file_inode->i_mtime;
-			return (int)size_write;
-		}
-	}
+	return write_inode(fs, get_file(fi), buf, size, offset);
+}
 
-	if (offset_block < VSFS_NUM_DIRECT) {
-		vsfs_dentry *write_location = (vsfs_dentry *)(fs->image + path_file_inode->i_direct[offset_block] * VSFS_BLOCK_SIZE + (offset % VSFS_BLOCK_SIZE));
-		if (write_location->ino != VSFS_BLK_UNASSIGNED) {
-			memset(write_location, VSFS_BLK_UNASSIGNED, strlen(write_location->name));
-		}
-		memcpy(write_location, buf, size_write);
-		if (clock_gettime(CLOCK_REALTIME, &(path_file_inode->i_mtime)) != 0) {
-			perror("clock_gettime");
-			return -ENOSYS;
-		}
-		root_inode->i_mtime = path_file_inode->i_mtime;
-		return (int)size_write;
-	}
-	else {
-		vsfs_blk_t *indirect_block_number = (vsfs_blk_t *)(fs->image + path_file_inode->i_indirect * VSFS_BLOCK_SIZE);
-		offset_block -= VSFS_NUM_DIRECT;
-		vsfs_dentry *write_location = (vsfs_dentry *)(fs->image + indirect_block_number[offset_block] * VSFS_BLOCK_SIZE + (offset % VSFS_BLOCK_SIZE));
-		if (write_location->ino != VSFS_BLK_UNASSIGNED) {
-			memset(write_location, VSFS_BLK_UNASSIGNED, strlen(write_location->name));
-		}
-		memcpy(write_location, buf, size_write);
-		if (clock_gettime(CLOCK_REALTIME, &(path_file_inode->i_mtime)) != 0) {
-			perror("clock_gettime");
-			return -ENOSYS;
-		}
-		root_inode->i_mtime = path_file_inode->i_mtime;
-		return (int)size_write;
-	}
+/**
+ * Write data to a file without copying it first.
+ *
+ * Takes the place of vsfs_write() when FUSE supports it. The data comes in a
+ * buffer vector, which may refer to a pipe that FUSE spliced the request
+ * into, and is copied straight to the blocks of the file by their offsets in
+ * the image file (see write_inode_buf()), so that it can be spliced again.
+ * Otherwise the same as vsfs_write().
+ *
+ * @param path    unused.
+ * @param buf     buffer vector containing the data.
+ * @param offset  offset from the beginning of the file to write to.
+ * @param fi      file info of the open file.
+ * @return        number of bytes written on success; -errno on error.
+ */
+static int vsfs_write_buf(const char *path, struct fuse_bufvec *buf,
+                          off_t offset, struct fuse_file_info *fi)
+{
+	(void)path;// unused
+	fs_ctx *fs = get_fs();
 
-	return -1;
+	return write_inode_buf(fs, get_file(fi), buf, offset);
 }
 
 
 static struct fuse_operations vsfs_ops = {
-	.destroy  = vsfs_destroy,
-	.statfs   = vsfs_statfs,
-	.getattr  = vsfs_getattr,
-	.readdir  = vsfs_readdir,
-	.create   = vsfs_create,
-	.unlink   = vsfs_unlink,
-	.utimens  = vsfs_utimens,
-	.truncate = vsfs_truncate,
-	.read     = vsfs_read,
-	.write    = vsfs_write,
+	.destroy   = vsfs_destroy,
+	.statfs    = vsfs_statfs,
+	.getattr   = vsfs_getattr,
+	.readdir   = vsfs_readdir,
+	.create    = vsfs_create,
+	.open      = vsfs_open,
+	.release   = vsfs_release,
+	.unlink    = vsfs_unlink,
+	.utimens   = vsfs_utimens,
+	.truncate  = vsfs_truncate,
+	.ftruncate = vsfs_ftruncate,
+	.read      = vsfs_read,
+	.read_buf  = vsfs_read_buf,
+	.write     = vsfs_write,
+	.write_buf = vsfs_write_buf,
+
+	// read(), write() and ftruncate() only use fi->fh, so FUSE doesn't need
+	// to work out the path of an open file for them (readdir() still gets its
+	// path, so flag_nopath must not be set)
+	.flag_nullpath_ok = 1,
 };
 
 int main(int argc, char *argv[])
@@ -876,5 +632,11 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (opts.lowlevel && !opts.help) {
+		int ret = vsfs_ll_main(&args, &fs, &opts);
+		vsfs_destroy(&fs);
+		return ret;
+	}
+
 	return fuse_main(args.argc, args.argv, &vsfs_ops, &fs);
 }
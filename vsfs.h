@@ -22,6 +22,7 @@
 #pragma once
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <limits.h>
 #include <sys/stat.h>
@@ -54,6 +55,23 @@ typedef uint32_t vsfs_ino_t;
  *   Block 2: data bitmap
  *   Block 3: start of inode table
  *   First data block after inode table
+ *
+ * Images that are too large for one bitmap block each have
+ * VSFS_SB_MULTI_BITMAP set, and the superblock describes the layout instead:
+ *   Block 0: superblock
+ *   Block 1: first of sb_imap_blocks inode bitmap blocks
+ *   Next sb_dmap_blocks blocks: data bitmap
+ *   Next block: start of inode table
+ *   First data block after inode table
+ *
+ * Images formatted with block groups (VSFS_SB_BLOCK_GROUPS) also split the
+ * blocks into groups of sb_blocks_per_group blocks, and the inodes into groups
+ * of sb_inodes_per_group inodes. The bitmaps stay packed at the start of the
+ * image, but each group holds the inode table slice of its own inodes, so that
+ * a file's inode and data can be close together:
+ *   Group 0: superblock, bitmaps, inode table slice, data blocks
+ *   Group n: inode table slice, data blocks
+ * sb_data_region is the first data block of group 0.
  */
 
 #define VSFS_SB_BLKNUM   0
@@ -72,12 +90,81 @@ typedef struct vsfs_superblock {
 	vsfs_blk_t sb_num_blocks;  /* File system size in blocks */
 	vsfs_blk_t sb_free_blocks; /* Number of available blocks in file sys */
 	vsfs_blk_t sb_data_region; /* First block after inode table */ 
+	uint32_t   sb_flags;       /* Optional format features (VSFS_SB_*) */
+	uint32_t   sb_imap_blocks; /* Inode bitmap blocks (VSFS_SB_MULTI_BITMAP) */
+	uint32_t   sb_dmap_blocks; /* Data bitmap blocks (VSFS_SB_MULTI_BITMAP) */
+	vsfs_blk_t sb_blocks_per_group; /* Blocks in a group (VSFS_SB_BLOCK_GROUPS) */
+	uint32_t   sb_inodes_per_group; /* Inodes in a group (VSFS_SB_BLOCK_GROUPS) */
+	uint32_t   sb_inode_size;  /* Inode slot size in bytes (VSFS_SB_INLINE_DATA) */
 } vsfs_superblock;
 
+/**
+ * The root directory uses the hashed format (see VSFS_HASHED_DIR_BUCKETS).
+ * Set by mkfs; images without it use the plain unsorted dentry array.
+ */
+#define VSFS_SB_HASHED_DIR 0x1
+
+/**
+ * The root directory uses variable length entries (see vsfs_dentry_var).
+ * Set by mkfs; cannot be combined with VSFS_SB_HASHED_DIR.
+ */
+#define VSFS_SB_VARLEN_DIR 0x2
+
+/**
+ * The inode and data bitmaps may span several blocks, as given by
+ * sb_imap_blocks and sb_dmap_blocks. Set by mkfs only when the image needs
+ * more than one block for either bitmap, so that smaller images keep the
+ * fixed layout.
+ */
+#define VSFS_SB_MULTI_BITMAP 0x4
+
+/**
+ * Blocks and inodes are split into block groups, each with its own slice of
+ * the inode table. Set by mkfs on request; always comes with
+ * VSFS_SB_MULTI_BITMAP.
+ */
+#define VSFS_SB_BLOCK_GROUPS 0x8
+
+/**
+ * Regular files map their data with extents (see vsfs_extent) instead of
+ * direct and indirect block pointers. Set by mkfs on request; directories
+ * keep using block pointers.
+ */
+#define VSFS_SB_EXTENTS 0x10
+
+/**
+ * Inodes take up sb_inode_size bytes in the inode table instead of
+ * sizeof(vsfs_inode), and small regular files keep their data in the inode
+ * (see VSFS_INODE_INLINE_MAX). Set by mkfs on request.
+ */
+#define VSFS_SB_INLINE_DATA 0x20
+
+/** All superblock flags understood by this version of vsfs. */
+#define VSFS_SB_KNOWN_FLAGS (VSFS_SB_HASHED_DIR | VSFS_SB_VARLEN_DIR | VSFS_SB_MULTI_BITMAP | \
+                             VSFS_SB_BLOCK_GROUPS | VSFS_SB_EXTENTS | VSFS_SB_INLINE_DATA)
+
 /* Superblock must fit into a single disk sector */
 static_assert(sizeof(vsfs_superblock) <= VSFS_BLOCK_SIZE,
               "superblock is too large");
 
+/**
+ * Extent: a run of blocks that are contiguous both in a file and on disk.
+ *
+ * The extents of a file are sorted by e_lblk and never overlap or touch (runs
+ * that would be adjacent both in the file and on disk are merged). Up to
+ * VSFS_INLINE_EXTENTS of them are kept in the inode itself; a file with more
+ * keeps all of them in an extent block instead, which holds up to
+ * VSFS_BLOCK_EXTENTS.
+ */
+typedef struct vsfs_extent {
+	uint32_t   e_lblk; /* First block of the run within the file */
+	vsfs_blk_t e_pblk; /* Block number of the first block of the run */
+	uint32_t   e_len;  /* Number of blocks in the run */
+} vsfs_extent;
+
+#define VSFS_INLINE_EXTENTS 2
+#define VSFS_BLOCK_EXTENTS  (VSFS_BLOCK_SIZE / sizeof(vsfs_extent))
+
 /** vsfs inode. */
 typedef struct vsfs_inode {
 	/** File mode. */
@@ -95,7 +182,20 @@ typedef struct vsfs_inode {
 
 	/** File size in vsfs file system blocks */
 	vsfs_blk_t i_blocks;
-	
+
+	union {
+		/** Number of extents (regular files on VSFS_SB_EXTENTS images). */
+		uint32_t i_num_extents;
+		/**
+		 * Double indirect block of a regular file mapped with block
+		 * pointers, or of a hashed root directory: a block of pointers to
+		 * indirect blocks, which map the blocks past those mapped by
+		 * i_indirect. Only meaningful once a regular file has that many
+		 * blocks; older versions left this unset.
+		 */
+		vsfs_blk_t i_double_indirect;
+	};
+
 	/** File size in bytes. */
 	uint64_t i_size;
 
@@ -108,17 +208,43 @@ typedef struct vsfs_inode {
 	 */
 	struct timespec i_mtime;
 
-	/** Data pointers. */
-	vsfs_blk_t i_direct[VSFS_NUM_DIRECT];
-	vsfs_blk_t i_indirect;
+	union {
+		/** Data pointers. */
+		struct {
+			vsfs_blk_t i_direct[VSFS_NUM_DIRECT];
+			vsfs_blk_t i_indirect;
+		};
+		/** Extents, if there are at most VSFS_INLINE_EXTENTS of them. */
+		vsfs_extent i_extents[VSFS_INLINE_EXTENTS];
+		/** Otherwise, the block holding the extents. */
+		vsfs_blk_t i_extent_block;
+	};
 } vsfs_inode;
 
+static_assert(sizeof(vsfs_inode) == 64, "inodes must stay 64 bytes");
+
 /** A single block must fit an integral number of inodes */
 static_assert(VSFS_BLOCK_SIZE % sizeof(vsfs_inode) == 0, "invalid inode size");
 
+/** Largest inode slot size (sb_inode_size); it must be a power of 2. */
+#define VSFS_INODE_SIZE_MAX 1024
+
+/**
+ * Largest regular file that keeps its data inline, in an inode slot of the
+ * given size: the data starts at i_direct, in place of the block map, and
+ * runs to the end of the slot. A regular file on a VSFS_SB_INLINE_DATA image
+ * that has data but no blocks (i_size > 0, i_blocks == 0) is inline; it moves
+ * to data blocks once it grows past this size.
+ */
+#define VSFS_INODE_INLINE_MAX(inode_size) ((inode_size) - offsetof(vsfs_inode, i_direct))
+
 /**
  *  Since we only have 1 inode bitmap block, there can be at most 
  *  VSFS_BLOCK_SIZE * bits_per_byte inodes in the file system.
+ *
+ *  The value also marks unused directory entries, so images with more
+ *  inodes (VSFS_SB_MULTI_BITMAP) have inode number VSFS_INO_MAX marked
+ *  as in use by mkfs; it is never allocated.
  */
 #define VSFS_INO_MAX VSFS_BLOCK_SIZE*CHAR_BIT
 
@@ -134,6 +260,8 @@ static_assert(VSFS_ROOT_INO < (VSFS_BLOCK_SIZE / sizeof(vsfs_inode)),
 /**
  *  Since we only have 1 data bitmap block, there can be at most 
  *  VSFS_BLOCK_SIZE * bits_per_byte blocks in the file system.
+ *  Larger images use multi-block bitmaps (VSFS_SB_MULTI_BITMAP), and are
+ *  only limited by the range of vsfs_blk_t.
  */
 #define VSFS_BLK_MAX VSFS_BLOCK_SIZE*CHAR_BIT
 
@@ -145,7 +273,7 @@ static_assert(VSFS_ROOT_INO < (VSFS_BLOCK_SIZE / sizeof(vsfs_inode)),
 #define VSFS_BLK_MIN 5
 
 /** 
- * Data block numbers must be > VSFS_ITBL_BLKNUM and < VSFS_BLK_MAX
+ * Data block numbers must be past the inode table and < sb_num_blocks
  * for any VSFS file system, but we define 0 as the expected value to use 
  * for an unassigned data block number in an inode or indirect block. 
  */
@@ -167,3 +295,56 @@ typedef struct vsfs_dentry {
 } vsfs_dentry;
 
 static_assert(sizeof(vsfs_dentry) == 256, "invalid dentry size");
+
+/**
+ * Variable length directory entry (record) header, used instead of
+ * vsfs_dentry when the superblock has VSFS_SB_VARLEN_DIR.
+ *
+ * The records of a directory block are stored back to back and always cover
+ * the whole block: each one starts rec_len bytes after the previous one. The
+ * name follows the header and is padded so that records stay 4-byte aligned;
+ * any space past that up to rec_len is free and a new entry can be split off
+ * from it. A removed entry is merged into the record before it, or, if it is
+ * the first record in the block, kept with ino set to VSFS_INO_MAX.
+ */
+typedef struct vsfs_dentry_var {
+	/** Inode number; VSFS_INO_MAX if the record is unused. */
+	vsfs_ino_t ino;
+	/** Length of the record in bytes, including any free space after it. */
+	uint16_t rec_len;
+	/** Length of the name, not including the null terminator. */
+	uint16_t name_len;
+	/** File name. A null-terminated string. */
+	char name[];
+} vsfs_dentry_var;
+
+static_assert(sizeof(vsfs_dentry_var) == 8, "invalid dentry record header size");
+
+/** Number of bytes a variable length entry needs for a name of name_len chars. */
+#define VSFS_DENTRY_VAR_LEN(name_len) \
+	((sizeof(vsfs_dentry_var) + (name_len) + 1 + 3) & ~(size_t)3)
+
+/**
+ * Number of hash buckets in a hashed root directory.
+ *
+ * An entry's home bucket is dir_name_hash(name) % VSFS_HASHED_DIR_BUCKETS.
+ * Bucket b is a chain of directory blocks at positions b, b + BUCKETS,
+ * b + 2 * BUCKETS, ... in the root directory, which maps its blocks like a
+ * regular file does (direct blocks, then the indirect block, then the double
+ * indirect block). An entry goes to the first free slot in its bucket's
+ * chain, and a new block is added at the end of the chain when all of its
+ * blocks are full. A lookup reads only the chain of the name's home bucket,
+ * up to its first missing block. A removed entry's slot is simply freed; a
+ * block left empty at the end of its chain is released (along with any
+ * indirect block that no longer maps anything), so chains never have gaps.
+ *
+ * With 4 KiB blocks a chain can be 1025 blocks long, so a bucket holds at
+ * least 16,400 entries and the directory about 16.8 million. A lookup reads
+ * one block for every 16 entries in its bucket: about 2 blocks with 32,768
+ * entries, or 7 with 100,000.
+ */
+#define VSFS_HASHED_DIR_BUCKETS 1024
+
+/** The first block of every bucket is a direct block or in the indirect block. */
+static_assert(VSFS_HASHED_DIR_BUCKETS <= VSFS_NUM_DIRECT + VSFS_BLOCK_SIZE / sizeof(vsfs_blk_t),
+              "too many hashed directory buckets");
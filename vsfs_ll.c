@@ -0,0 +1,401 @@
+/**
+ * CSC369 Assignment 4 - vsfs FUSE low-level front end.
+ *
+ * Serves the same fs_ctx as the path-based callbacks in vsfs.c, but the
+ * kernel refers to files by inode number, so names are only ever resolved in
+ * lookup(), create() and unlink(). Enabled with the "-o lowlevel" option.
+ */
+
+// Using 2.9.x FUSE API
+#define FUSE_USE_VERSION 29
+#include <fuse_lowlevel.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vsfs_ll.h"
+#include "helper_functions.h"
+
+/** Seconds the kernel may cache names and attributes returned by vsfs. */
+#define VSFS_LL_TIMEOUT 1.0
+
+/** Low-level front end state, passed to every request as its userdata. */
+typedef struct vsfs_ll_ctx {
+	/** Context of the file system being served. */
+	fs_ctx *fs;
+	/** Seconds the kernel may cache failed lookups. */
+	double negative_timeout;
+	/**
+	 * Number of references the kernel holds to each inode (see forget()).
+	 * An unlinked inode is only freed once this drops to zero, so that files
+	 * that are still open stay readable and writable.
+	 */
+	uint64_t *nlookup;
+} vsfs_ll_ctx;
+
+/** FUSE reserves inode number 0, so vsfs inode numbers are shifted by one. */
+static fuse_ino_t to_fuse_ino(vsfs_ino_t ino)
+{
+	return (fuse_ino_t)ino + FUSE_ROOT_ID;
+}
+
+static vsfs_ino_t to_vsfs_ino(fuse_ino_t ino)
+{
+	return (vsfs_ino_t)(ino - FUSE_ROOT_ID);
+}
+
+/** Get the attributes of an inode, with st_ino as the kernel knows it. */
+static void ll_stat(fs_ctx *fs, vsfs_ino_t ino, struct stat *st)
+{
+	fill_inode_stat(fs, ino, st);
+	st->st_ino = to_fuse_ino(ino);
+}
+
+/**
+ * Fill in the reply for a name that resolved to the given inode and count the
+ * reference that the kernel takes to it.
+ */
+static void ll_entry(vsfs_ll_ctx *ll, vsfs_ino_t ino, struct fuse_entry_param *e)
+{
+	memset(e, 0, sizeof(*e));
+	e->ino = to_fuse_ino(ino);
+	e->attr_timeout = VSFS_LL_TIMEOUT;
+	e->entry_timeout = VSFS_LL_TIMEOUT;
+	ll_stat(ll->fs, ino, &e->attr);
+	ll->nlookup[ino] += 1;
+}
+
+/** Drop references to an inode, freeing it if it was the last one to an unlinked file. */
+static void ll_forget_one(vsfs_ll_ctx *ll, vsfs_ino_t ino, uint64_t nlookup)
+{
+	assert(ll->nlookup[ino] >= nlookup);
+	ll->nlookup[ino] -= nlookup;
+	if (ll->nlookup[ino] == 0 && fs_inode(ll->fs, ino)->i_nlink == 0) {
+		free_inode(ll->fs, ino);
+	}
+}
+
+static void vsfs_ll_destroy(void *userdata)
+{
+	vsfs_ll_ctx *ll = (vsfs_ll_ctx *)userdata;
+
+	// The kernel doesn't forget the remaining inodes on unmount, so free the
+	// unlinked files that were still open
+	for (uint32_t ino = 0; ino < ll->fs->sb->sb_num_inodes; ++ino) {
+		if (ll->nlookup[ino] > 0) {
+			ll_forget_one(ll, ino, ll->nlookup[ino]);
+		}
+	}
+}
+
+static void vsfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	vsfs_ll_ctx *ll = fuse_req_userdata(req);
+	assert(to_vsfs_ino(parent) == VSFS_ROOT_INO);
+
+	if (strlen(name) >= VSFS_NAME_MAX) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+
+	dir_index_entry entry;
+	if (!root_dir_lookup(ll->fs, name, &entry)) {
+		// A zero inode number lets the kernel cache the miss
+		struct fuse_entry_param e = { .ino = 0, .entry_timeout = ll->negative_timeout };
+		fuse_reply_entry(req, &e);
+		return;
+	}
+
+	struct fuse_entry_param e;
+	ll_entry(ll, entry.ino, &e);
+	fuse_reply_entry(req, &e);
+}
+
+static void vsfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	vsfs_ll_ctx *ll = fuse_req_userdata(req);
+	ll_forget_one(ll, to_vsfs_ino(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+static void vsfs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	vsfs_ll_ctx *ll = fuse_req_userdata(req);
+	for (size_t i = 0; i < count; ++i) {
+		ll_forget_one(ll, to_vsfs_ino(forgets[i].ino), forgets[i].nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+static void vsfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	vsfs_ll_ctx *ll = fuse_req_userdata(req);
+
+	struct stat st;
+	ll_stat(ll->fs, to_vsfs_ino(ino), &st);
+	fuse_reply_attr(req, &st, VSFS_LL_TIMEOUT);
+}
+
+/** Implements truncate() and utimensat(); see vsfs_truncate() and vsfs_utimens(). */
+static void vsfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                            int to_set, struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	vsfs_ll_ctx *ll = fuse_req_userdata(req);
+	vsfs_ino_t vino = to_vsfs_ino(ino);
+	vsfs_inode *inode = fs_inode(ll->fs, vino);
+
+	// Like the path-based front end, vsfs has no chmod() or chown()
+	if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		int err = truncate_inode(ll->fs, vino, attr->st_size);
+		if (err != 0) {
+			fuse_reply_err(req, -err);
+			return;
+		}
+	}
+
+	if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+		if (clock_gettime(CLOCK_REALTIME, &(inode->i_mtime)) != 0) {
+			assert(false);
+		}
+	} else if (to_set & FUSE_SET_ATTR_MTIME) {
+		inode->i_mtime = attr->st_mtim;
+	}
+
+	struct stat st;
+	ll_stat(ll->fs, vino, &st);
+	fuse_reply_attr(req, &st, VSFS_LL_TIMEOUT);
+}
+
+/** Buffer that directory entries are added to by ll_filler(). */
+typedef struct ll_dirbuf {
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t used;
+} ll_dirbuf;
+
+/** fuse_fill_dir_t for read_directory_entries() that adds entries to an ll_dirbuf. */
+static int ll_filler(void *buf, const char *name, const struct stat *stbuf, off_t off)
+{
+	ll_dirbuf *db = (ll_dirbuf *)buf;
+	struct stat st = *stbuf;
+	st.st_ino = to_fuse_ino(st.st_ino);
+
+	size_t len = fuse_add_direntry(db->req, db->buf + db->used, db->size - db->used, name, &st, off);
+	if (len > db->size - db->used) {
+		return 1;
+	}
+	db->used += len;
+	return 0;
+}
+
+static void vsfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                            off_t off, struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	vsfs_ll_ctx *ll = fuse_req_userdata(req);
+	assert(to_vsfs_ino(ino) == VSFS_ROOT_INO);
+
+	ll_dirbuf db = { .req = req, .buf = malloc(size), .size = size, .used = 0 };
+	if (db.buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	read_directory_entries(ll->fs, off, &db, ll_filler);
+	fuse_reply_buf(req, db.buf, db.used);
+	free(db.buf);
+}
+
+static void vsfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           mode_t mode, struct fuse_file_info *fi)
+{
+	vsfs_ll_ctx *ll = fuse_req_userdata(req);
+	assert(to_vsfs_ino(parent) == VSFS_ROOT_INO);
+
+	if (strlen(name) >= VSFS_NAME_MAX) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+	dir_index_entry entry;
+	if (root_dir_lookup(ll->fs, name, &entry)) {
+		fuse_reply_err(req, EEXIST);
+		return;
+	}
+
+	open_file *file = open_file_new(VSFS_INO_MAX);
+	if (file == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	int err = create_file(ll->fs, name, mode, &file->ino);
+	if (err != 0) {
+		free(file);
+		fuse_reply_err(req, -err);
+		return;
+	}
+
+	struct fuse_entry_param e;
+	ll_entry(ll, file->ino, &e);
+	fi->fh = (uintptr_t)file;
+	fuse_reply_create(req, &e, fi);
+}
+
+static void vsfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	vsfs_ll_ctx *ll = fuse_req_userdata(req);
+	assert(to_vsfs_ino(parent) == VSFS_ROOT_INO);
+
+	dir_index_entry entry;
+	if (!root_dir_lookup(ll->fs, name, &entry)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	// The inode is freed once the kernel forgets it (see ll_forget_one())
+	int err = remove_dir_entry(ll->fs, &entry);
+	if (err == 0 && ll->nlookup[entry.ino] == 0) {
+		free_inode(ll->fs, entry.ino);
+	}
+	fuse_reply_err(req, err == 0 ? 0 : EIO);
+}
+
+static void vsfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	open_file *file = open_file_new(to_vsfs_ino(ino));
+	if (file == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	fi->fh = (uintptr_t)file;
+	fuse_reply_open(req, fi);
+}
+
+static void vsfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)ino;// unused
+	vsfs_ll_ctx *ll = fuse_req_userdata(req);
+	open_file_free(ll->fs, (open_file *)(uintptr_t)fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void vsfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                         off_t off, struct fuse_file_info *fi)
+{
+	(void)ino;// unused
+	vsfs_ll_ctx *ll = fuse_req_userdata(req);
+
+	// The data is spliced from the image file rather than copied
+	struct fuse_bufvec *bufv;
+	int ret = read_inode_buf(ll->fs, (open_file *)(uintptr_t)fi->fh, size, off, &bufv);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fuse_reply_data(req, bufv, 0);
+	free_bufvec(bufv);
+}
+
+static void vsfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                          size_t size, off_t off, struct fuse_file_info *fi)
+{
+	(void)ino;// unused
+	vsfs_ll_ctx *ll = fuse_req_userdata(req);
+
+	int ret = write_inode(ll->fs, (open_file *)(uintptr_t)fi->fh, buf, size, off);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+	} else {
+		fuse_reply_write(req, ret);
+	}
+}
+
+static void vsfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+                              struct fuse_bufvec *bufv, off_t off,
+                              struct fuse_file_info *fi)
+{
+	(void)ino;// unused
+	vsfs_ll_ctx *ll = fuse_req_userdata(req);
+
+	// The data is spliced into the image file rather than copied
+	int ret = write_inode_buf(ll->fs, (open_file *)(uintptr_t)fi->fh, bufv, off);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+	} else {
+		fuse_reply_write(req, ret);
+	}
+}
+
+static void vsfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	(void)ino;// unused
+	vsfs_ll_ctx *ll = fuse_req_userdata(req);
+
+	struct statvfs st;
+	fill_statvfs(ll->fs, &st);
+	fuse_reply_statfs(req, &st);
+}
+
+static struct fuse_lowlevel_ops vsfs_ll_ops = {
+	.destroy      = vsfs_ll_destroy,
+	.lookup       = vsfs_ll_lookup,
+	.forget       = vsfs_ll_forget,
+	.forget_multi = vsfs_ll_forget_multi,
+	.getattr      = vsfs_ll_getattr,
+	.setattr      = vsfs_ll_setattr,
+	.readdir      = vsfs_ll_readdir,
+	.create       = vsfs_ll_create,
+	.unlink       = vsfs_ll_unlink,
+	.open         = vsfs_ll_open,
+	.release      = vsfs_ll_release,
+	.read         = vsfs_ll_read,
+	.write        = vsfs_ll_write,
+	.write_buf    = vsfs_ll_write_buf,
+	.statfs       = vsfs_ll_statfs,
+};
+
+int vsfs_ll_main(struct fuse_args *args, fs_ctx *fs, vsfs_opts *opts)
+{
+	vsfs_ll_ctx ll = {
+		.fs = fs,
+		.negative_timeout = opts->negative_timeout,
+		.nlookup = calloc(fs->sb->sb_num_inodes, sizeof(uint64_t)),
+	};
+	if (ll.nlookup == NULL) {
+		return 1;
+	}
+
+	char *mountpoint;
+	int foreground;
+	int err = -1;
+	if (fuse_parse_cmdline(args, &mountpoint, NULL, &foreground) != -1) {
+		struct fuse_chan *ch = fuse_mount(mountpoint, args);
+		if (ch != NULL) {
+			struct fuse_session *se = fuse_lowlevel_new(args, &vsfs_ll_ops, sizeof(vsfs_ll_ops), &ll);
+			if (se != NULL) {
+				if (fuse_set_signal_handlers(se) != -1) {
+					fuse_session_add_chan(se, ch);
+					if (fuse_daemonize(foreground) != -1) {
+						err = fuse_session_loop(se);
+					}
+					fuse_remove_signal_handlers(se);
+					fuse_session_remove_chan(ch);
+				}
+				fuse_session_destroy(se);
+			}
+			fuse_unmount(mountpoint, ch);
+		}
+		free(mountpoint);
+	}
+
+	free(ll.nlookup);
+	return err ? 1 : 0;
+}
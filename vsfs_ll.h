@@ -0,0 +1,21 @@
+/**
+ * CSC369 Assignment 4 - vsfs FUSE low-level front end header file.
+ */
+
+#pragma once
+
+#include <fuse_opt.h>
+
+#include "fs_ctx.h"
+#include "options.h"
+
+/**
+ * Mount the file system and serve requests through the FUSE low-level
+ * (inode-based) API until it is unmounted.
+ *
+ * @param args  FUSE arguments, as prepared by vsfs_opt_parse().
+ * @param fs    initialized file system context to serve.
+ * @param opts  command line options.
+ * @return      0 on success; 1 on failure (exit status for main()).
+ */
+int vsfs_ll_main(struct fuse_args *args, fs_ctx *fs, vsfs_opts *opts);